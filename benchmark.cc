@@ -0,0 +1,43 @@
+#include "thread.h"
+#include "time.h"
+#include "scene.h"
+#include "renderer.h"
+#include "rasterizer.h"
+
+/// Compares planar and interleaved layouts of published samples (random texel sampling and full view rasterization)
+/// \note Arguments: scene [samples=2^24] [size=1024]
+struct Benchmark {
+    Scene scene {::loadScene(basename(arguments()[0]))};
+    Render renderer {scene};
+    Rasterizer<TextureShader> rasterizer {scene};
+
+    Benchmark() {
+        const uint sampleCount = arguments().size > 1 ? parseInteger(arguments()[1]) : 1<<24;
+        const uint2 size (arguments().size > 2 ? parseInteger(arguments()[2]) : 1024);
+        ImageH B (size), G (size), R (size);
+        mat4 M = shearedPerspective(0, 0, scene.near, scene.far);
+        M.scale(scene.scale); // Fits scene within -1, 1
+        bgr3f results[2];
+        for(uint layout: range(2)) {
+            const bool interleaved = layout;
+            renderer.setLayout(interleaved);
+            setST(scene, 1./3, 2./3); // Off grid (s,t)
+            Random random;
+            bgr3f sum (0.f);
+            Time time (true);
+            for(uint unused i: range(sampleCount)) {
+                const uint face = random.next()%scene.size;
+                const float u = random()*(scene.size1[face]-1), v = random()*(scene.V[face]-1);
+                sum += sample(scene, face, u, v);
+            }
+            const float sampleTime = time.reset().seconds();
+            results[layout] = sum;
+            const uint frameCount = 16;
+            for(uint unused i: range(frameCount)) ::rasterize(rasterizer, scene, M, (float[]){1,1,1}, {}, B, G, R);
+            log(interleaved ? "Interleaved" : "Planar", sampleTime*1e9/sampleCount, "ns/sample", time.seconds()*1e3/frameCount, "ms/frame");
+            const auto& hiZ = rasterizer.pass.hiZCounters; // Last frame
+            log("Hi-Z rejected", strD(hiZ.faceRejects, hiZ.faces), "of", hiZ.faces, "tile faces,", strD(hiZ.blockRejects, hiZ.blocks), "of", hiZ.blocks, "blocks");
+        }
+        log("Checksums", results[0], results[1]); // Same random sequence (should match up to rounding)
+    }
+} benchmark;
@@ -203,6 +203,31 @@ Map::~Map() { unmap(); }
 
 int Map::lock(size_t size) const { return mlock(data, min<size_t>(this->size,size)); }
 
+int Map::sync() const { return msync((void*)data, size, MS_SYNC); }
+
+/// Rounds range start down to page boundary (madvise requires page aligned start)
+static ref<byte> pages(const Map& map, size_t offset, size_t size) {
+ const size_t pageSize = 4096;
+ const size_t begin = offset & ~(pageSize-1); // Maps are page aligned
+ const size_t end = min(offset+size, map.size);
+ return ref<byte>(map.data+begin, end-begin);
+}
+
+int Map::prefetch(size_t offset, size_t size) const {
+ const ref<byte> range = pages(*this, offset, size);
+ return madvise((void*)range.data, range.size, MADV_WILLNEED);
+}
+
+int Map::evict(size_t offset, size_t size) const {
+ const ref<byte> range = pages(*this, offset, size);
+ if(msync((void*)range.data, range.size, MS_SYNC)) return -1;
+#ifdef MADV_PAGEOUT
+ return madvise((void*)range.data, range.size, MADV_PAGEOUT); // Reclaims page cache
+#else
+ return madvise((void*)range.data, range.size, MADV_DONTNEED); // Unmaps (page cache reclaimed on demand)
+#endif
+}
+
 void Map::unmap() {
  if(data) munmap((void*)data, size);
  data=0, size=0;
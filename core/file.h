@@ -177,6 +177,12 @@ struct Map : mref<byte> {
 
  /// Locks memory map in RAM
  int lock(size_t size=~0) const;
+ /// Writes back modified pages to file
+ int sync() const;
+ /// Hints pages of [offset, offset+size) will be accessed soon (asynchronous read ahead)
+ int prefetch(size_t offset, size_t size) const;
+ /// Writes back pages of [offset, offset+size) and releases them from RAM (next access faults them back from file)
+ int evict(size_t offset, size_t size) const;
 
  /// Unmaps memory map
  void unmap();
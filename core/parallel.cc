@@ -21,6 +21,7 @@ thread threads[::maxThreadCount];
 
 Semaphore jobs __attribute((init_priority(101)));
 Semaphore results __attribute((init_priority(101)));
+Lock pool __attribute((init_priority(101))); // Serializes loops submitted from concurrent threads
 
 int threadCount() {
  static int threadCount = ({
@@ -85,6 +86,7 @@ uint64 parallel_for(int64 start, int64 stop, function<void(uint, uint)> delegate
   return time.cycleCount();
 #else
   assert_(threadCount == ::threadCount());
+  Locker locker(pool);
   for(int index: range(::threadCount())) {
    threads[index].counter = &start;
    threads[index].stop = stop;
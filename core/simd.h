@@ -96,6 +96,13 @@ inline float hsum(v8sf x) {
     return (sumDual + __builtin_shufflevector(sumDual, sumDual, 1, -1, -1, -1))[0]; // 0+4+2+6 + 1+5+3+7
 }
 inline float hsum(v16sf v) { return hsum(v.r1+v.r2); }
+inline v16sf max(v16sf a, v16sf b) { return v16sf(max(a.r1, b.r1), max(a.r2, b.r2)); }
+inline float hmax(v16sf v) {
+    const v8sf x = max(v.r1, v.r2);
+    const v4sf quad = __builtin_ia32_maxps(__builtin_shufflevector(x, x, 0, 1, 2, 3), __builtin_shufflevector(x, x, 4, 5, 6, 7));
+    const v4sf dual = __builtin_ia32_maxps(quad, __builtin_shufflevector(quad, quad, 2, 3, -1, -1));
+    return ::max(dual[0], dual[1]);
+}
 
 /// 16-wide vector operations using 2 v8si AVX registers
 struct v16si {
@@ -165,6 +172,7 @@ inline v8hf toHalf(const v8sf v) { return __builtin_ia32_vcvtps2ph256(v, 0); }
 
 inline v16hf toHalf(const v16sf v) { return __builtin_shufflevector(toHalf(v.r1), toHalf(v.r2), 0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15); }
 
+inline v8sf toFloat(const v8hf v) { return __builtin_ia32_vcvtph2ps256(v); }
 inline v4sf toFloat(const v4hf v) { return {(float)v[0], (float)v[1], (float)v[2], (float)v[3]}; }
 inline v16sf toFloat(const v16hf v) {
     return v16sf(__builtin_ia32_vcvtph2ps256(__builtin_shufflevector(v, v, 0+0, 0+1, 0+2, 0+3, 0+4, 0+5, 0+6, 0+7)),
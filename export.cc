@@ -0,0 +1,63 @@
+#include "thread.h"
+#include "time.h"
+#include "scene.h"
+#include "renderer.h"
+#include "rasterizer.h"
+
+/// Exports radiosity solution as dual-plane light field (NxNxWxH half Z/B/G/R planes in /var/tmp/light/name)
+/// \note Arguments: scene [N=8] [size=960] [iterations=16] [mode=indirect (ao, direct, indirect)]
+struct Export {
+    static Radiosity::Mode mode() {
+        if(arguments().size <= 4) return Radiosity::Indirect;
+        const size_t index = ref<string>(Radiosity::modes).indexOf(arguments()[4]);
+        assert_(index != invalid, "Unknown mode", arguments()[4], "(ao, direct, indirect)");
+        return Radiosity::Mode(index);
+    }
+    Scene scene {::loadScene(basename(arguments()[0]))};
+    Render renderer {scene, mode()};
+    Rasterizer<TextureShader> rasterizer {scene};
+
+    Export() {
+        const uint N = arguments().size > 1 ? parseInteger(arguments()[1]) : 8;
+        const uint2 size (arguments().size > 2 ? parseInteger(arguments()[2]) : 960);
+        const uint iterationCount = arguments().size > 3 ? parseInteger(arguments()[3]) : 16;
+        assert_(N >= 2, N);
+
+        Time time (true);
+        while(scene.iterations < iterationCount) renderer.step(); // Resumes solution up to requested iteration count
+        log("Solved", scene.iterations, Radiosity::modes[renderer.radiosity.mode], "iterations in", time);
+
+        const Folder tmp {"/var/tmp/light",currentWorkingDirectory(), true};
+        Folder folder {basename(arguments()[0]), tmp, true};
+        for(string file: folder.list(Files)) if(file != str(N)+'x'+str(N)+'x'+strx(size)) log("Warning: dual-plane loads the first field of", folder.name(), "(", file, ")");
+
+        File file(str(N)+'x'+str(N)+'x'+strx(size), folder, Flags(ReadWrite|Create));
+        size_t byteSize = 4ull*N*N*size.y*size.x*sizeof(half);
+        assert_(byteSize <= 28800ull*1024*1024, byteSize/(1024*1024*1024.f));
+        file.resize(byteSize);
+        Map map (file, Map::Prot(Map::Read|Map::Write));
+        mref<half> field = mcast<half>(map);
+
+        time.reset(); Time lastReport (true);
+        const float near = scene.near, far = scene.far;
+        for(uint stIndex: range(N*N)) {
+            const uint sIndex = stIndex%N, tIndex = stIndex/N;
+            if(stIndex && lastReport.seconds()>1) { log(strD(stIndex,N*N)); lastReport.reset(); }
+
+            // Sheared perspective (rectification)
+            const float s = 2*(sIndex/float(N-1))-1, t = 2*(tIndex/float(N-1))-1;
+            mat4 M = shearedPerspective(s, t, near, far);
+            M.scale(scene.scale); // Fits scene within -1, 1
+
+            ImageH Z (unsafeRef(field.slice(((0ull*N+tIndex)*N+sIndex)*size.y*size.x, size.y*size.x)), size);
+            ImageH B (unsafeRef(field.slice(((1ull*N+tIndex)*N+sIndex)*size.y*size.x, size.y*size.x)), size);
+            ImageH G (unsafeRef(field.slice(((2ull*N+tIndex)*N+sIndex)*size.y*size.x, size.y*size.x)), size);
+            ImageH R (unsafeRef(field.slice(((3ull*N+tIndex)*N+sIndex)*size.y*size.x, size.y*size.x)), size);
+            setST(scene, (s+1)/2, (t+1)/2);
+            ::rasterize(rasterizer, scene, M, (float[]){0,0,0}, Z, B, G, R);
+            // Normalized device depth to (orthogonal) distance to ST plane relative to UV plane (z=near)
+            for(half& z: Z) z = float(z) >= 1 ? inff : 2*far/((far+near) - float(z)*(far-near));
+        }
+        log("Exported",strx(uint2(N)),"x",strx(size),Radiosity::modes[renderer.radiosity.mode],"images in", time);
+    }
+} exporter;
@@ -2,6 +2,7 @@
 #include "scene.h"
 #include "mwc.h"
 #include "sphere.h"
+#include "function.h"
 
 inline void cross(const v8sf Ax, const v8sf Ay, const v8sf Az, const v8sf Bx, const v8sf By, const v8sf Bz, v8sf& X, v8sf& Y, v8sf& Z) {
     X = Ay*Bz - By*Az;
@@ -44,6 +45,12 @@ inline v8sf hmin(const v8sf x) {
     return __builtin_ia32_minps256(v1, _mm256_permute2x128_si256(v1, v1, 0x01));
 }
 
+inline v8sf hmax(const v8sf x) {
+    const v8sf v0 = __builtin_ia32_maxps256(x, _mm256_alignr_epi8(x, x, 4));
+    const v8sf v1 = __builtin_ia32_maxps256(v0, _mm256_alignr_epi8(v0, v0, 8));
+    return __builtin_ia32_maxps256(v1, _mm256_permute2x128_si256(v1, v1, 0x01));
+}
+
 inline uint indexOfEqual(const v8sf x, const v8sf y) {
     return __builtin_ctz(::mask(x == y));
 }
@@ -137,13 +144,373 @@ struct Lookup {
     }
 };
 
+#define BVH 1 // Traverses 8-wide bounding volume hierarchy (0: linear scan of all faces)
+
+/// 8-wide bounding volume hierarchy over the scene triangles
+/// \note Children bounds are stored as 8-wide slabs to be tested at once, leaves hold 8 triangles copied in leaf order for aligned loads by the intersect kernel
+struct Hierarchy {
+    static constexpr uint leaf = 1u<<31; // Flags child as leaf (index of first triangle in leaf order)
+    static constexpr uint maxStack = 128; // Traversal stack capacity (front to back traversals push at most 7 more entries per level)
+    struct Node {
+        float minX[8], minY[8], minZ[8], maxX[8], maxY[8], maxZ[8]; // Children bounds (empty children: min=∞, max=-∞)
+        uint child[8]; // Inner node index or leaf|triangle index
+    };
+    buffer<Node> nodes;
+    // Leaf triangles (8 per leaf, padded with degenerate triangles)
+    buffer<float> X0, X1, X2, Y0, Y1, Y2, Z0, Z1, Z2;
+    buffer<uint> face; // Scene face index (scene.size for padding)
+
+    Hierarchy(const Scene& scene) {
+        if(!scene.size) return;
+        buffer<vec3> centroids (scene.size);
+        for(size_t i: range(scene.size)) centroids[i] = vec3(scene.X0[i]+scene.X1[i]+scene.X2[i],
+                                                             scene.Y0[i]+scene.Y1[i]+scene.Y2[i],
+                                                             scene.Z0[i]+scene.Z1[i]+scene.Z2[i])/3.f;
+        buffer<uint> order (scene.size);
+        for(size_t i: range(scene.size)) order[i] = i;
+        array<Node> nodes; // Unaligned during construction
+        array<uint2> leaves; // Ranges of order
+        nodes.append();
+        build(scene, centroids, nodes, 0, order, order.data, leaves);
+        this->nodes = copyRef(nodes);
+        const uint depth = levels(0);
+        assert_(1+7*depth <= maxStack, depth, "levels overflow traversal stack"); // Release builds do not check pushes
+        // Copies leaf triangles
+        const size_t capacity = 8*leaves.size;
+        for(buffer<float>* P: {&X0,&X1,&X2,&Y0,&Y1,&Y2,&Z0,&Z1,&Z2}) { *P = buffer<float>(capacity); P->clear(0); }
+        face = buffer<uint>(capacity); face.clear(scene.size);
+        for(size_t leafIndex: range(leaves.size)) {
+            const uint2 range = leaves[leafIndex];
+            for(size_t k: ::range(range[1])) {
+                const size_t i = 8*leafIndex+k, f = order[range[0]+k];
+                X0[i] = scene.X0[f]; Y0[i] = scene.Y0[f]; Z0[i] = scene.Z0[f];
+                X1[i] = scene.X1[f]; Y1[i] = scene.Y1[f]; Z1[i] = scene.Z1[f];
+                X2[i] = scene.X2[f]; Y2[i] = scene.Y2[f]; Z2[i] = scene.Z2[f];
+                face[i] = f;
+            }
+        }
+    }
+
+    /// Top-down median split of faces (8 children per node, 8 triangles per leaf)
+    static void build(const Scene& scene, ref<vec3> centroids, array<Node>& nodes, const size_t nodeIndex, mref<uint> faces, const uint* order, array<uint2>& leaves) {
+        // Splits largest group until there are 8 children or all groups fit leaves
+        array<mref<uint>> groups; groups.append(faces);
+        while(groups.size < 8) {
+            size_t largest = 0;
+            for(size_t i: range(groups.size)) if(groups[i].size > groups[largest].size) largest = i;
+            const mref<uint> group = groups[largest];
+            if(group.size <= 8) break;
+            vec3 min = inff, max = -inff;
+            for(uint f: group) { min = ::min(min, centroids[f]); max = ::max(max, centroids[f]); }
+            const vec3 extent = max-min;
+            const uint axis = extent.x >= extent.y && extent.x >= extent.z ? 0 : extent.y >= extent.z ? 1 : 2;
+            sort<uint>([&](const uint& a, const uint& b) { return centroids[a][axis] < centroids[b][axis]; }, group);
+            const size_t split = align(8, group.size/2); // Full left leaves
+            groups[largest] = group.slice(0, split);
+            groups.insertAt(largest+1, group.slice(split));
+        }
+        for(size_t childIndex: range(8)) {
+            Node& node = nodes[nodeIndex];
+            if(childIndex >= groups.size) {
+                node.minX[childIndex] = node.minY[childIndex] = node.minZ[childIndex] = inff;
+                node.maxX[childIndex] = node.maxY[childIndex] = node.maxZ[childIndex] = -inff;
+                node.child[childIndex] = 0;
+                continue;
+            }
+            const mref<uint> group = groups[childIndex];
+            vec3 min = inff, max = -inff;
+            for(uint f: group) {
+                min = ::min(min, ::min(vec3(scene.X0[f], scene.Y0[f], scene.Z0[f]), ::min(vec3(scene.X1[f], scene.Y1[f], scene.Z1[f]), vec3(scene.X2[f], scene.Y2[f], scene.Z2[f]))));
+                max = ::max(max, ::max(vec3(scene.X0[f], scene.Y0[f], scene.Z0[f]), ::max(vec3(scene.X1[f], scene.Y1[f], scene.Z1[f]), vec3(scene.X2[f], scene.Y2[f], scene.Z2[f]))));
+            }
+            node.minX[childIndex] = min.x; node.minY[childIndex] = min.y; node.minZ[childIndex] = min.z;
+            node.maxX[childIndex] = max.x; node.maxY[childIndex] = max.y; node.maxZ[childIndex] = max.z;
+            if(group.size <= 8) {
+                node.child[childIndex] = leaf | (8*leaves.size);
+                leaves.append(uint2(group.data-order, group.size));
+            } else {
+                const size_t childNodeIndex = nodes.size;
+                node.child[childIndex] = childNodeIndex;
+                nodes.append(); // Invalidates node
+                build(scene, centroids, nodes, childNodeIndex, group, order, leaves);
+            }
+        }
+    }
+
+    /// Inner node levels from \a node (included)
+    uint levels(size_t node) const {
+        uint levels = 0;
+        for(uint k: range(8)) {
+            const Node& n = nodes[node];
+            if(n.minX[k] <= n.maxX[k] && !(n.child[k] & leaf)) levels = ::max(levels, this->levels(n.child[k])); // Skips empty children and leaves
+        }
+        return 1+levels;
+    }
+
+    explicit operator bool() const { return nodes; }
+};
+
 struct Radiosity {
     const Scene& scene;
     Lookup lookup;
+#if BVH
+    Hierarchy hierarchy {scene};
+#endif
+
+    static constexpr uint maxGroupCount = 8; // Light groups solved as separate bases
+
+    /// Radiance gathered by hemispheric rasterization
+    enum Mode {
+        AO, // Ambient occlusion (unoccluded distance)
+        Direct, // Emittance of visible faces (single bounce)
+        Indirect // Radiance of visible texels from previous iterations (progressive multiple bounces)
+    } mode;
+    static constexpr string modes[] = {"ao"_, "direct"_, "indirect"_}; // Names of Mode (arguments, sample files)
+
+#if BVH
+    /// Maximum angular size (bounding radius / distance) of face clusters gathered as a single aggregated face (0: faces only)
+    /// \note Opt-in: clusters are gathered as opaque spheres (approximates Indirect, biases AO and Direct), default exact gather
+    float clusterError = 0;
+    buffer<float> clusterB, clusterG, clusterR; // Aggregated radiance of each cluster (node*8+child) (area weighted mean scaled by coverage)
+#endif
+
+    Radiosity(const Scene& scene, Mode mode = AO) : scene(scene), mode(mode) {}
+
+#if BVH
+    /// Aggregates radiance of face clusters (emittance (Direct) or published diffuse texture at face centroids (Indirect))
+    /// \note Called after each publication of the diffuse texture
+    void update() {
+        if(!hierarchy) return;
+        const size_t size = scene.groupCount*8*hierarchy.nodes.size;
+        if(clusterB.size != size) for(buffer<float>* C: {&clusterB, &clusterG, &clusterR}) *C = buffer<float>(size);
+        for(uint g: range(scene.groupCount)) {
+            bgr3f unused sum; float unused area;
+            aggregate(g, 0, sum, area);
+        }
+    }
 
-    Radiosity(const Scene& scene) : scene(scene) {}
+    /// Accumulates area weighted radiance \a sum (of light group \a group) and \a area of faces below \a node
+    void aggregate(const uint group, const uint node, bgr3f& sum, float& area) {
+        sum = 0, area = 0;
+        for(uint k: range(8)) {
+            const Hierarchy::Node& n = hierarchy.nodes[node];
+            const vec3 min (n.minX[k], n.minY[k], n.minZ[k]), max (n.maxX[k], n.maxY[k], n.maxZ[k]);
+            bgr3f childSum = 0; float childArea = 0;
+            if(min <= max) {
+                const uint child = n.child[k];
+                if(child & Hierarchy::leaf) {
+                    for(size_t i: range(child & ~Hierarchy::leaf, (child & ~Hierarchy::leaf)+8)) {
+                        const uint face = hierarchy.face[i];
+                        if(face == scene.size) continue;
+                        const float a = length(cross(vec3(scene.X1[face]-scene.X0[face], scene.Y1[face]-scene.Y0[face], scene.Z1[face]-scene.Z0[face]),
+                                                     vec3(scene.X2[face]-scene.X0[face], scene.Y2[face]-scene.Y0[face], scene.Z2[face]-scene.Z0[face])))/2;
+                        bgr3f L = 0;
+                        if(mode == Direct) { if(scene.group[face] == group) L = bgr3f(scene.emittanceB[face], scene.emittanceG[face], scene.emittanceR[face]); }
+                        else if(mode == Indirect) { // Nearest texel to centroid
+                            const uint u = (scene.U0[face]+scene.U1[face]+scene.U2[face])/3, v = (scene.V0[face]+scene.V1[face]+scene.V2[face])/3;
+                            const float* texel = scene.diffuseBasis.data + group*(scene.diffuseBasis.size/scene.groupCount) + scene.diffuseBGR[face] + v*scene.size1[face] + u;
+                            const size_t size2 = scene.size2[face];
+                            L = bgr3f(texel[0*size2], texel[1*size2], texel[2*size2]);
+                        }
+                        childSum += a*L;
+                        childArea += a;
+                    }
+                } else aggregate(group, child, childSum, childArea);
+            }
+            // Fraction of bounding sphere section covered by faces (mean projected area of a face is a quarter of its area)
+            const float radius = length(max-min)/2;
+            const float coverage = min <= max && radius ? ::min(1.f, childArea/(4*PI*sq(radius))) : 0;
+            const bgr3f L = childArea ? coverage/childArea*childSum : bgr3f(0.f);
+            const size_t index = (group*hierarchy.nodes.size+node)*8+k;
+            clusterB[index] = L.b;
+            clusterG[index] = L.g;
+            clusterR[index] = L.r;
+            sum += childSum;
+            area += childArea;
+        }
+    }
+#endif
+
+#if BVH
+    /// Traverses hierarchy front to back from \a root (scalar ray)
+    inline void traverse(uint root, vec3 O, vec3 d, float& minT, size_t& index, float& u, float& v) const {
+        const v8sf Ox = float8(O.x);
+        const v8sf Oy = float8(O.y);
+        const v8sf Oz = float8(O.z);
+        const v8sf dx = float8(d.x);
+        const v8sf dy = float8(d.y);
+        const v8sf dz = float8(d.z);
+        const vec3 invD (1/d.x, 1/d.y, 1/d.z); // Signed infinity for ±0 components (selects slab consistently with its sign)
+        const v8sf iX = float8(invD.x);
+        const v8sf iY = float8(invD.y);
+        const v8sf iZ = float8(invD.z);
+        uint stack[Hierarchy::maxStack]; float stackT[Hierarchy::maxStack]; uint stackSize = 0;
+        stack[stackSize] = root; stackT[stackSize] = 0; stackSize++;
+        while(stackSize) {
+            stackSize--;
+            if(stackT[stackSize] >= minT) continue;
+            const uint child = stack[stackSize];
+            if(child & Hierarchy::leaf) {
+                const size_t i = child & ~Hierarchy::leaf;
+                const v8sf Ax = *(v8sf*)(hierarchy.X0.data+i);
+                const v8sf Ay = *(v8sf*)(hierarchy.Y0.data+i);
+                const v8sf Az = *(v8sf*)(hierarchy.Z0.data+i);
+                const v8sf Bx = *(v8sf*)(hierarchy.X1.data+i);
+                const v8sf By = *(v8sf*)(hierarchy.Y1.data+i);
+                const v8sf Bz = *(v8sf*)(hierarchy.Z1.data+i);
+                const v8sf Cx = *(v8sf*)(hierarchy.X2.data+i);
+                const v8sf Cy = *(v8sf*)(hierarchy.Y2.data+i);
+                const v8sf Cz = *(v8sf*)(hierarchy.Z2.data+i);
+                v8sf det, U, V;
+                const v8sf t = ::intersect(Ax,Ay,Az, Bx,By,Bz, Cx,Cy,Cz, Ox,Oy,Oz, dx,dy,dz, det, U, V);
+                v8sf hmin = ::hmin(t);
+                const float hmin0 = hmin[0];
+                if(hmin0 >= minT) continue;
+                minT = hmin0;
+                uint k = ::indexOfEqual(t, hmin);
+                index = hierarchy.face[i + k];
+                u = U[k]/det[k];
+                v = V[k]/det[k];
+                continue;
+            }
+            const Hierarchy::Node& node = hierarchy.nodes[child];
+            // Slab test of all 8 children
+            const v8sf nearX = (*(v8sf*)(invD.x >= 0 ? node.minX : node.maxX) - Ox) * iX;
+            const v8sf nearY = (*(v8sf*)(invD.y >= 0 ? node.minY : node.maxY) - Oy) * iY;
+            const v8sf nearZ = (*(v8sf*)(invD.z >= 0 ? node.minZ : node.maxZ) - Oz) * iZ;
+            const v8sf farX = (*(v8sf*)(invD.x >= 0 ? node.maxX : node.minX) - Ox) * iX;
+            const v8sf farY = (*(v8sf*)(invD.y >= 0 ? node.maxY : node.minY) - Oy) * iY;
+            const v8sf farZ = (*(v8sf*)(invD.z >= 0 ? node.maxZ : node.minZ) - Oz) * iZ;
+            const v8sf near = max(max(nearX, nearY), max(nearZ, float8(0)));
+            const v8sf far = min(min(farX, farY), min(farZ, float8(minT)));
+            // Pushes hit children far to near (nearest is popped first)
+            const uint base = stackSize;
+            for(uint hits = ::mask(near <= far); hits; hits &= hits-1) {
+                const uint k = __builtin_ctz(hits);
+                assert(stackSize < Hierarchy::maxStack); // Bounded by depth (checked on construction)
+                uint i = stackSize++;
+                for(; i > base && stackT[i-1] < near[k]; i--) { stack[i] = stack[i-1]; stackT[i] = stackT[i-1]; }
+                stack[i] = node.child[k]; stackT[i] = near[k];
+            }
+        }
+    }
+
+    static constexpr uint divergent = 2; // Maximum active rays to switch from packet to single ray traversal
+
+    /// Traverses hierarchy with a packet of 8 rays
+    /// \note Children hit by at most \a divergent rays are traversed separately by each ray
+    inline void traverse(const v8sf Ox, const v8sf Oy, const v8sf Oz, const v8sf dx, const v8sf dy, const v8sf dz, v8sf& minT, v8ui& index, v8sf& u, v8sf& v) const {
+        const v8sf iX = 1/dx, iY = 1/dy, iZ = 1/dz;
+        const v8si negX = iX < 0, negY = iY < 0, negZ = iZ < 0; // Sign of inverse (-0 => -∞)
+        uint stack[Hierarchy::maxStack]; float stackT[Hierarchy::maxStack]; uint stackSize = 0;
+        stack[stackSize] = 0; stackT[stackSize] = 0; stackSize++;
+        while(stackSize) {
+            stackSize--;
+            if(stackT[stackSize] >= hmax(minT)[0]) continue;
+            const uint child = stack[stackSize];
+            if(child & Hierarchy::leaf) {
+                const size_t first = child & ~Hierarchy::leaf;
+                for(size_t i: range(first, first+8)) {
+                    const uint face = hierarchy.face[i];
+                    const float Ax = hierarchy.X0[i];
+                    const float Ay = hierarchy.Y0[i];
+                    const float Az = hierarchy.Z0[i];
+                    const float Bx = hierarchy.X1[i];
+                    const float By = hierarchy.Y1[i];
+                    const float Bz = hierarchy.Z1[i];
+                    const float Cx = hierarchy.X2[i];
+                    const float Cy = hierarchy.Y2[i];
+                    const float Cz = hierarchy.Z2[i];
+                    v8sf det, U, V;
+                    const v8sf t = ::intersect(Ax,Ay,Az, Bx,By,Bz, Cx,Cy,Cz, Ox,Oy,Oz, dx,dy,dz, det, U, V);
+                    index = blend(index, uintX(face), t < minT);
+                    u = blend(u, U/det, t < minT);
+                    v = blend(v, V/det, t < minT);
+                    minT = ::min(minT, t);
+                }
+                continue;
+            }
+            const Hierarchy::Node& node = hierarchy.nodes[child];
+            const uint base = stackSize;
+            for(uint k: range(8)) {
+                const v8sf nearX = (blend(float8(node.minX[k]), float8(node.maxX[k]), negX) - Ox) * iX;
+                const v8sf nearY = (blend(float8(node.minY[k]), float8(node.maxY[k]), negY) - Oy) * iY;
+                const v8sf nearZ = (blend(float8(node.minZ[k]), float8(node.maxZ[k]), negZ) - Oz) * iZ;
+                const v8sf farX = (blend(float8(node.maxX[k]), float8(node.minX[k]), negX) - Ox) * iX;
+                const v8sf farY = (blend(float8(node.maxY[k]), float8(node.minY[k]), negY) - Oy) * iY;
+                const v8sf farZ = (blend(float8(node.maxZ[k]), float8(node.minZ[k]), negZ) - Oz) * iZ;
+                const v8sf near = max(max(nearX, nearY), max(nearZ, float8(0)));
+                const v8sf far = min(min(farX, farY), min(farZ, minT));
+                const v8si hit = near <= far;
+                const uint hits = ::mask(hit);
+                if(!hits) continue;
+                if(__builtin_popcount(hits) <= divergent) { // Diverged packet: traverses subtree with single rays
+                    for(uint lanes = hits; lanes; lanes &= lanes-1) {
+                        const uint lane = __builtin_ctz(lanes);
+                        float t = minT[lane], laneU = u[lane], laneV = v[lane]; size_t laneIndex = index[lane];
+                        traverse(node.child[k], vec3(Ox[lane], Oy[lane], Oz[lane]), vec3(dx[lane], dy[lane], dz[lane]), t, laneIndex, laneU, laneV);
+                        minT[lane] = t; index[lane] = laneIndex; u[lane] = laneU; v[lane] = laneV;
+                    }
+                    continue;
+                }
+                const float nearest = hmin(blend(float8(inff), near, hit))[0];
+                // Pushes hit children far to near (nearest is popped first)
+                assert(stackSize < Hierarchy::maxStack); // Bounded by depth (checked on construction)
+                uint i = stackSize++;
+                for(; i > base && stackT[i-1] < nearest; i--) { stack[i] = stack[i-1]; stackT[i] = stackT[i-1]; }
+                stack[i] = node.child[k]; stackT[i] = nearest;
+            }
+        }
+    }
+#endif
 
     inline size_t raycast(vec3 O, vec3 d) const {
+#if BVH
+        float unused t, u, v;
+        return raycast(O, d, t, u, v);
+#else
+        return raycast_linear(O, d);
+#endif
+    }
+
+    inline size_t raycast(vec3 O, vec3 d, float& minT, float& u, float& v) const {
+#if BVH
+        minT = inff; size_t index = scene.size;
+        if(hierarchy) traverse(0, O, d, minT, index, u, v);
+#if DEBUG
+        { float t, tu, tv; raycast_linear(O, d, t, tu, tv); assert_(t == minT, t, minT); } // Checks traversal against linear scan
+#endif
+        return index;
+#else
+        return raycast_linear(O, d, minT, u, v);
+#endif
+    }
+
+    inline v8ui raycast(const v8sf Ox, const v8sf Oy, const v8sf Oz, const v8sf dx, const v8sf dy, const v8sf dz) const {
+#if BVH
+        v8sf unused t, u, v;
+        return raycast(Ox,Oy,Oz, dx,dy,dz, t, u, v);
+#else
+        return raycast_linear(Ox,Oy,Oz, dx,dy,dz);
+#endif
+    }
+
+    inline v8ui raycast(const v8sf Ox, const v8sf Oy, const v8sf Oz, const v8sf dx, const v8sf dy, const v8sf dz, v8sf& minT, v8sf& u, v8sf& v) const {
+#if BVH
+        minT = inff; v8ui index = uintX(scene.size);
+        if(hierarchy) traverse(Ox,Oy,Oz, dx,dy,dz, minT, index, u, v);
+#if DEBUG
+        { v8sf t, tu, tv; raycast_linear(Ox,Oy,Oz, dx,dy,dz, t, tu, tv); for(uint k: range(8)) assert_(t[k] == minT[k], t[k], minT[k]); } // Checks traversal against linear scan
+#endif
+        return index;
+#else
+        return raycast_linear(Ox,Oy,Oz, dx,dy,dz, minT, u, v);
+#endif
+    }
+
+    // Linear scan of all faces (reference)
+
+    inline size_t raycast_linear(vec3 O, vec3 d) const {
         assert(scene.size < scene.capacity && align(8, scene.size)==scene.capacity);
         float value = inff; size_t index = scene.size;
         const v8sf Ox = float8(O.x);
@@ -173,7 +540,7 @@ struct Radiosity {
         return index;
     }
 
-    inline size_t raycast(vec3 O, vec3 d, float& minT, float& u, float& v) const {
+    inline size_t raycast_linear(vec3 O, vec3 d, float& minT, float& u, float& v) const {
         assert(scene.size < scene.capacity && align(8, scene.size)==scene.capacity);
         minT = inff; size_t index = scene.size;
         const v8sf Ox = float8(O.x);
@@ -241,7 +608,7 @@ struct Radiosity {
     }
 #endif
 
-    inline v8ui raycast(const v8sf Ox, const v8sf Oy, const v8sf Oz, const v8sf dx, const v8sf dy, const v8sf dz) const {
+    inline v8ui raycast_linear(const v8sf Ox, const v8sf Oy, const v8sf Oz, const v8sf dx, const v8sf dy, const v8sf dz) const {
         v8sf value = float8(inff); v8ui index = uintX(scene.size);
         for(size_t i: range(scene.size)) {
             const float Ax = scene.X0[i];
@@ -261,7 +628,7 @@ struct Radiosity {
         return index;
     }
 
-    inline v8ui raycast(const v8sf Ox, const v8sf Oy, const v8sf Oz, const v8sf dx, const v8sf dy, const v8sf dz, v8sf& minT, v8sf& u, v8sf& v) const {
+    inline v8ui raycast_linear(const v8sf Ox, const v8sf Oy, const v8sf Oz, const v8sf dx, const v8sf dy, const v8sf dz, v8sf& minT, v8sf& u, v8sf& v) const {
         minT = inff; v8ui index = uintX(scene.size);
         for(size_t i: range(scene.size)) {
             const float Ax = scene.X0[i];
@@ -283,8 +650,82 @@ struct Radiosity {
         return index;
     }
 
-    bgr3f shade(uint faceIndex, const vec3 P, const unused vec3 D, const vec3 T, const vec3 B, const vec3 N, Random& random) const {
-        bgr3f out (scene.emittanceB[faceIndex], scene.emittanceG[faceIndex], scene.emittanceR[faceIndex]);
+    /// Rasterizes 8 faces (vertices relative to shading point) on the hemisphere of the (T, B, N) frame
+    /// Keeps nearest hit distance \a depth and face \a id along each of the Lookup::S directions
+    inline void rasterize(const v8ui faces, const v8si valid,
+                          const v8sf X0, const v8sf Y0, const v8sf Z0,
+                          const v8sf X1, const v8sf Y1, const v8sf Z1,
+                          const v8sf X2, const v8sf Y2, const v8sf Z2,
+                          const v8sf FNX, const v8sf FNY, const v8sf FNZ,
+                          const vec3 T, const vec3 B, const vec3 N, const uint faceIndex, float depth[Lookup::S], uint id[Lookup::S]) const {
+        const float m00 = T.x, m01 = T.y, m02 = T.z;
+        const float m10 = B.x, m11 = B.y, m12 = B.z;
+        const float m20 = N.x, m21 = N.y, m22 = N.z;
+        const float* Sx = lookup.X.data;
+        const float* Sy = lookup.Y.data;
+        const float* Sz = lookup.Z.data;
+        const v8sf D0 = N.x * X0 + N.y * Y0 + N.z * Z0;
+        const v8sf D1 = N.x * X1 + N.y * Y1 + N.z * Z1;
+        const v8sf D2 = N.x * X2 + N.y * Y2 + N.z * Z2;
+        const v8sf D = FNX*X0 + FNY*Y0 + FNZ*Z0;
+        const v8si cull = ~valid || (D0 <= 0 && D1 <= 0 && D2 <= 0) /*Plane*/ || D <= 0 /*Backward*/;
+        if(::mask(cull) == 0xFF) return;
+        v8sf C0x, C0y, C0z; cross(X2,Y2,Z2, X1,Y1,Z1, C0x,C0y,C0z);
+        v8sf C1x, C1y, C1z; cross(X0,Y0,Z0, X2,Y2,Z2, C1x,C1y,C1z);
+        v8sf C2x, C2y, C2z; cross(X1,Y1,Z1, X0,Y0,Z0, C2x,C2y,C2z);
+        const v8sf N0x = m00 * C0x + m01 * C0y + m02 * C0z;
+        const v8sf N0y = m10 * C0x + m11 * C0y + m12 * C0z;
+        const v8sf N0z = m20 * C0x + m21 * C0y + m22 * C0z;
+        const v8sf N1x = m00 * C1x + m01 * C1y + m02 * C1z;
+        const v8sf N1y = m10 * C1x + m11 * C1y + m12 * C1z;
+        const v8sf N1z = m20 * C1x + m21 * C1y + m22 * C1z;
+        const v8sf N2x = m00 * C2x + m01 * C2y + m02 * C2z;
+        const v8sf N2y = m10 * C2x + m11 * C2y + m12 * C2z;
+        const v8sf N2z = m20 * C2x + m21 * C2y + m22 * C2z;
+        // FIXME: cull/repack here ?
+        const v8ui lookup0 = lookup.index(N0x, N0y, N0z);
+        const v8ui lookup1 = lookup.index(N1x, N1y, N1z);
+        const v8ui lookup2 = lookup.index(N2x, N2y, N2z);
+        // Face normals in (T, B, N) frame of lookup directions
+        const v8sf LNX = m00 * FNX + m01 * FNY + m02 * FNZ;
+        const v8sf LNY = m10 * FNX + m11 * FNY + m12 * FNZ;
+        const v8sf LNZ = m20 * FNX + m21 * FNY + m22 * FNZ;
+        for(uint k: range(8)) {
+            if(cull[k]) continue; // FIXME
+            if(faces[k] == faceIndex) continue; // FIXME:
+            const Lookup::mask mask = lookup.lookup[lookup0[k]] & lookup.lookup[lookup1[k]] & lookup.lookup[lookup2[k]];
+            // FIXME: cull/repack here ?
+            for(uint s=0; s<Lookup::S; s+=8) {
+                const v8sf ti = D[k] / (LNX[k]*(*(v8sf*)(Sx+s)) + LNY[k]*(*(v8sf*)(Sy+s)) + LNZ[k]*(*(v8sf*)(Sz+s)));
+                v8sf& t = *(v8sf*)(depth+s);
+                const v8si mask8 = ::mask(((uint8*)&mask)[s/8]) & (ti > 0) & (ti < t);
+                store(t, mask8, ti);
+                store(*(v8si*)(id+s), mask8, intX(faces[k]));
+            }
+        }
+    }
+
+    /// Rasterizes the bounding sphere (center \a C relative to shading point, \a radius) of a cluster as a single face \a clusterID
+    inline void rasterize(const vec3 C, const float radius, const vec3 T, const vec3 B, const vec3 N, const uint clusterID, float depth[Lookup::S], uint id[Lookup::S]) const {
+        const float d = length(C);
+        const vec3 c = vec3(dot(T, C), dot(B, C), dot(N, C))/d; // Direction in (T, B, N) frame of lookup directions
+        const float cosα = sqrt(1-sq(radius/d));
+        const v8sf t = float8(d-radius);
+        const float* Sx = lookup.X.data;
+        const float* Sy = lookup.Y.data;
+        const float* Sz = lookup.Z.data;
+        for(uint s=0; s<Lookup::S; s+=8) {
+            const v8sf cos = c.x*(*(v8sf*)(Sx+s)) + c.y*(*(v8sf*)(Sy+s)) + c.z*(*(v8sf*)(Sz+s));
+            v8sf& depth8 = *(v8sf*)(depth+s);
+            const v8si mask8 = (cos >= cosα) & (t < depth8);
+            store(depth8, mask8, t);
+            store(*(v8si*)(id+s), mask8, intX(clusterID));
+        }
+    }
+
+    /// Shades \a faceIndex at \a P with the emitters of each light group separately (out[scene.groupCount])
+    void shade(uint faceIndex, const vec3 P, const unused vec3 D, const vec3 T, const vec3 B, const vec3 N, Random& random, bgr3f out[]) const {
+        for(uint g: range(scene.groupCount)) out[g] = scene.group[faceIndex] == g ? bgr3f(scene.emittanceB[faceIndex], scene.emittanceG[faceIndex], scene.emittanceR[faceIndex]) : bgr3f(0.f);
         const bgr3f reflectance (scene.reflectanceB[faceIndex], scene.reflectanceG[faceIndex], scene.reflectanceR[faceIndex]);
 #if 0
         if(specular && face.reflect) { // FIXME: => face.reflect
@@ -359,155 +800,197 @@ struct Radiosity {
             const float Bx = cos*B.x - sin*T.x;
             const float By = cos*B.y - sin*T.y;
             const float Bz = cos*B.z - sin*T.z;
-            const float m00 = Tx,  m01 = Ty,  m02 = Tz;
-            const float m10 = Bx,  m11 = By,  m12 = Bz;
-            const float m20 = N.x, m21 = N.y, m22 = N.z;
             float T[Lookup::S]; mref<float>(T, Lookup::S).clear(inff);
             uint id[Lookup::S]; mref<uint>(id, Lookup::S).clear(scene.size);
-            const float* NX0 = scene.NX0.data, *NY0 = scene.NX1.data, *NZ0 = scene.NX2.data; // FIXME: face normal
-            const float* PX0 = scene.X0.data, *PX1 = scene.X1.data, *PX2 = scene.X2.data;
-            const float* PY0 = scene.Y0.data, *PY1 = scene.Y1.data, *PY2 = scene.X2.data;
-            const float* PZ0 = scene.Z0.data, *PZ1 = scene.Z1.data, *PZ2 = scene.X2.data;
-            const float* Sx = lookup.X.data;
-            const float* Sy = lookup.Y.data;
-            const float* Sz = lookup.Z.data;
-            for(uint i=0; i<scene.size; i+=8) {
-                const v8sf FNX = *(v8sf*)(NX0+i);
-                const v8sf FNY = *(v8sf*)(NY0+i);
-                const v8sf FNZ = *(v8sf*)(NZ0+i);
-                //v8sf FNx, FNy, FNz; cross(X1-X0,Y1-Y0,Z1-Z0, X2-X0,Y2-Y0,Z2-Z0, FNx,FNy,FNz);
-                const v8sf X0 = *(v8sf*)(PX0+i)-P.x;
-                const v8sf Y0 = *(v8sf*)(PY0+i)-P.y;
-                const v8sf Z0 = *(v8sf*)(PZ0+i)-P.z;
-                const v8sf X1 = *(v8sf*)(PX1+i)-P.x;
-                const v8sf Y1 = *(v8sf*)(PY1+i)-P.y;
-                const v8sf Z1 = *(v8sf*)(PZ1+i)-P.z;
-                const v8sf X2 = *(v8sf*)(PX2+i)-P.x;
-                const v8sf Y2 = *(v8sf*)(PY2+i)-P.y;
-                const v8sf Z2 = *(v8sf*)(PZ2+i)-P.z;
-                const v8sf D0 = N.x * X0 + N.y * Y0 + N.z * Z0;
-                const v8sf D1 = N.x * X1 + N.y * Y1 + N.z * Z1;
-                const v8sf D2 = N.x * X2 + N.y * Y2 + N.z * Z2;
-                static constexpr v8si seq {0,1,2,3,4,5,6,7};
-                const v8sf D = FNX*X0 + FNY*Y0 + FNZ*Z0;
-                const v8si cull = (i+seq >= scene.size) || (D0 <= 0 && D1 <= 0 && D2 <= 0) /*Plane*/ || D <= 0 /*Backward*/;
-                v8sf C0x, C0y, C0z; cross(X2,Y2,Z2, X1,Y1,Z1, C0x,C0y,C0z);
-                v8sf C1x, C1y, C1z; cross(X0,Y0,Z0, X2,Y2,Z2, C1x,C1y,C1z);
-                v8sf C2x, C2y, C2z; cross(X1,Y1,Z1, X0,Y0,Z0, C2x,C2y,C2z);
-                const v8sf N0x = m00 * C0x + m01 * C0y + m02 * C0z;
-                const v8sf N0y = m10 * C0x + m11 * C0y + m12 * C0z;
-                const v8sf N0z = m20 * C0x + m21 * C0y + m22 * C0z;
-                const v8sf N1x = m00 * C1x + m01 * C1y + m02 * C1z;
-                const v8sf N1y = m10 * C1x + m11 * C1y + m12 * C1z;
-                const v8sf N1z = m20 * C1x + m21 * C1y + m22 * C1z;
-                const v8sf N2x = m00 * C2x + m01 * C2y + m02 * C2z;
-                const v8sf N2y = m10 * C2x + m11 * C2y + m12 * C2z;
-                const v8sf N2z = m20 * C2x + m21 * C2y + m22 * C2z;
-                // FIXME: cull/repack here ?
-                const v8ui lookup0 = lookup.index(N0x, N0y, N0z);
-                const v8ui lookup1 = lookup.index(N1x, N1y, N1z);
-                const v8ui lookup2 = lookup.index(N2x, N2y, N2z);
-                for(uint k: range(8)) {
-                    if(cull[k]) continue; // FIXME
-                    if(i+k == faceIndex) continue; //assert_(i+k != faceIndex, D[k]); // FIXME:
-                    /*assert_(lookup0[k] < Lookup::N*Lookup::N && lookup1[k] < Lookup::N*Lookup::N && lookup2[k] < Lookup::N*Lookup::N, i, k, lookup0[k], lookup1[k], lookup2[k], N2x[k], N2y[k], N2z[k],
-                            m00, m01, m02, m10, m11, m12, m20, m21, m22, C2x[k], C2y[k], C2z[k], X0[k], Y0[k], Z0[k], X1[k], Y1[k], Z1[k], D0[k], D1[k], D2[k], D[k]);*/
-                    const Lookup::mask mask = lookup.lookup[lookup0[k]] & lookup.lookup[lookup1[k]] & lookup.lookup[lookup2[k]];
-                    // FIXME: cull/repack here ?
-                    for(uint s=0; s<Lookup::S; s+=8) {
-                        const v8sf ti = D / (FNX*(*(v8sf*)(Sx+s)) + FNY*(*(v8sf*)(Sy+s)) + FNZ*(*(v8sf*)(Sz+s)));
-                        v8sf& t = *(v8sf*)(T+s);
-                        const v8si mask8 = ::mask(((uint8*)&mask)[s/8]) & (ti > 0) & (ti < t);
-                        store(t, mask8, ti);
-                        store(*(v8si*)(id+s), mask8, i+k);
+            const vec3 frameT (Tx, Ty, Tz), frameB (Bx, By, Bz);
+#if BVH
+            if(hierarchy) { // Front to back traversal of face clusters above the tangent plane
+                const v8sf Px = float8(P.x), Py = float8(P.y), Pz = float8(P.z);
+                const float NP = dot(N, P);
+                float farthest = inff; // Farthest hit of all directions (clusters beyond can not occlude any direction)
+                uint stack[Hierarchy::maxStack]; float stackT[Hierarchy::maxStack]; uint stackSize = 0;
+                stack[stackSize] = 0; stackT[stackSize] = 0; stackSize++;
+                while(stackSize) {
+                    stackSize--;
+                    if(stackT[stackSize] >= farthest) continue;
+                    const uint child = stack[stackSize];
+                    if(child & Hierarchy::leaf) {
+                        const size_t i = child & ~Hierarchy::leaf;
+                        const v8ui faces = *(v8ui*)(hierarchy.face.data+i);
+                        rasterize(faces, faces != uintX(scene.size),
+                                  *(v8sf*)(hierarchy.X0.data+i)-P.x, *(v8sf*)(hierarchy.Y0.data+i)-P.y, *(v8sf*)(hierarchy.Z0.data+i)-P.z,
+                                  *(v8sf*)(hierarchy.X1.data+i)-P.x, *(v8sf*)(hierarchy.Y1.data+i)-P.y, *(v8sf*)(hierarchy.Z1.data+i)-P.z,
+                                  *(v8sf*)(hierarchy.X2.data+i)-P.x, *(v8sf*)(hierarchy.Y2.data+i)-P.y, *(v8sf*)(hierarchy.Z2.data+i)-P.z,
+                                  gather(scene.FNX.data, faces), gather(scene.FNY.data, faces), gather(scene.FNZ.data, faces),
+                                  frameT, frameB, N, faceIndex, T, id);
+                        v8sf max = 0;
+                        for(uint s=0; s<Lookup::S; s+=8) max = ::max(max, *(v8sf*)(T+s));
+                        farthest = hmax(max)[0];
+                        continue;
+                    }
+                    const Hierarchy::Node& node = hierarchy.nodes[child];
+                    // Distance from P to children bounds
+                    const v8sf dx = max(max(*(v8sf*)node.minX - Px, Px - *(v8sf*)node.maxX), float8(0));
+                    const v8sf dy = max(max(*(v8sf*)node.minY - Py, Py - *(v8sf*)node.maxY), float8(0));
+                    const v8sf dz = max(max(*(v8sf*)node.minZ - Pz, Pz - *(v8sf*)node.maxZ), float8(0));
+                    const v8sf near = sqrt(dx*dx + dy*dy + dz*dz);
+                    // Height of bounds corner furthest along N above tangent plane
+                    const v8sf above = N.x * *(v8sf*)(N.x >= 0 ? node.maxX : node.minX)
+                                     + N.y * *(v8sf*)(N.y >= 0 ? node.maxY : node.minY)
+                                     + N.z * *(v8sf*)(N.z >= 0 ? node.maxZ : node.minZ) - NP;
+                    uint visible = ::mask((above > 0) & (near < farthest));
+                    if(clusterError) { // Gathers distant clusters as single faces (ids after miss)
+                        const v8sf extentX = *(v8sf*)node.maxX - *(v8sf*)node.minX;
+                        const v8sf extentY = *(v8sf*)node.maxY - *(v8sf*)node.minY;
+                        const v8sf extentZ = *(v8sf*)node.maxZ - *(v8sf*)node.minZ;
+                        const v8sf radius = sqrt(extentX*extentX + extentY*extentY + extentZ*extentZ)/2;
+                        const uint clusters = visible & ::mask(radius < clusterError*near);
+                        for(uint hits = clusters; hits; hits &= hits-1) {
+                            const uint k = __builtin_ctz(hits);
+                            const vec3 C = vec3(node.minX[k]+node.maxX[k], node.minY[k]+node.maxY[k], node.minZ[k]+node.maxZ[k])/2.f;
+                            rasterize(C-P, radius[k], frameT, frameB, N, scene.size+1+child*8+k, T, id);
+                        }
+                        if(clusters) {
+                            v8sf max = 0;
+                            for(uint s=0; s<Lookup::S; s+=8) max = ::max(max, *(v8sf*)(T+s));
+                            farthest = hmax(max)[0];
+                        }
+                        visible &= ~clusters;
+                    }
+                    // Pushes children above hemisphere far to near (nearest is popped first)
+                    const uint base = stackSize;
+                    for(uint hits = visible; hits; hits &= hits-1) {
+                        const uint k = __builtin_ctz(hits);
+                        assert(stackSize < Hierarchy::maxStack); // Bounded by depth (checked on construction)
+                        uint i = stackSize++;
+                        for(; i > base && stackT[i-1] < near[k]; i--) { stack[i] = stack[i-1]; stackT[i] = stackT[i-1]; }
+                        stack[i] = node.child[k]; stackT[i] = near[k];
                     }
                 }
+            } else
+#endif
+            for(uint i=0; i<scene.size; i+=8) {
+                static constexpr v8ui seq {0,1,2,3,4,5,6,7};
+                const v8ui faces = i+seq;
+                rasterize(faces, faces < uintX(scene.size),
+                          *(v8sf*)(scene.X0.data+i)-P.x, *(v8sf*)(scene.Y0.data+i)-P.y, *(v8sf*)(scene.Z0.data+i)-P.z,
+                          *(v8sf*)(scene.X1.data+i)-P.x, *(v8sf*)(scene.Y1.data+i)-P.y, *(v8sf*)(scene.Z1.data+i)-P.z,
+                          *(v8sf*)(scene.X2.data+i)-P.x, *(v8sf*)(scene.Y2.data+i)-P.y, *(v8sf*)(scene.Z2.data+i)-P.z,
+                          *(v8sf*)(scene.FNX.data+i), *(v8sf*)(scene.FNY.data+i), *(v8sf*)(scene.FNZ.data+i),
+                          frameT, frameB, N, faceIndex, T, id);
             }
-            v8sf sumB = 0, sumG = 0, sumR = 0;
+            const uint groupCount = scene.groupCount;
+            v8sf sumB[maxGroupCount], sumG[maxGroupCount], sumR[maxGroupCount];
+            for(uint g: range(groupCount)) sumB[g] = sumG[g] = sumR[g] = 0;
             //sumB = sumG = sumR = Lookup::S/8.f; // Ambient
-            for(uint s=0; s<Lookup::S; s+=8) {
-#if 1 // "AO"
-                v8sf t = *(v8sf*)(T+s);
-                //for(int k: range(8)) assert_(t[k]>0, t[k]);
-                t = min(t, 1);
-                const v8sf b = t;
-                const v8sf g = t;
-                const v8sf r = t;
-#else
-                const v8si i = *(v8si*)(id+s);
-#if 1 // Direct
-                const v8sf b = gather(scene.emittanceB.data, i);
-                const v8sf g = gather(scene.emittanceG.data, i);
-                const v8sf r = gather(scene.emittanceR.data, i);
-#else // Indirect
-                const v8sf Dx = *(v8sf*)(Sx+s);
-                const v8sf Dy = *(v8sf*)(Sy+s);
-                const v8sf Dz = *(v8sf*)(Sz+s);
-                const v8sf X0 = gather(PX0, i);
-                const v8sf Y0 = gather(PY0, i);
-                const v8sf Z0 = gather(PZ0, i);
-                const v8sf X1 = gather(PX1, i);
-                const v8sf Y1 = gather(PY1, i);
-                const v8sf Z1 = gather(PZ1, i);
-                const v8sf X2 = gather(PX2, i);
-                const v8sf Y2 = gather(PY2, i);
-                const v8sf Z2 = gather(PZ2, i);
-                const v8sf e02x = X2 - X0;
-                const v8sf e02y = Y2 - Y0;
-                const v8sf e02z = Z2 - Z0;
-                v8sf Px, Py, Pz; cross(Dx, Dy, Dz, e02x, e02y, e02z, Px, Py, Pz);
-                const v8sf e01x = X1 - X0;
-                const v8sf e01y = Y1 - Y0;
-                const v8sf e01z = Z1 - Z0;
-                const v8sf det = dot(e01x, e01y, e01z, Px, Py, Pz);
-                const v8sf Tx = P.x - X0;
-                const v8sf Ty = P.y - Y0;
-                const v8sf Tz = P.z - Z0;
-                const v8si hit = i != scene.size;
-                const v8ui size1 = gather(scene.size1.data, i);
-                const v8sf u = and(hit, min(max(0.f, dot(Tx, Ty, Tz, Px, Py, Pz) / det), toFloat(size1-1)));
-                v8sf Qx, Qy, Qz; cross(Tx, Ty, Tz, e01x, e01y, e01z, Qx, Qy, Qz);
-                const v8ui V = gather(scene.V.data, i);
-                const v8sf v = and(hit, min(max(0.f, dot(Dx, Dy, Dz, Qx, Qy, Qz) / det), toFloat(V-1)));
-                const v8si vIndex = cvtt(v), uIndex = cvtt(u); // Floor
-                const Float* const base = scene.samples.data;
-                const v8ui faces = gather(scene.BGR.data, i);
-                const v8ui size4 = gather(scene.size4.data, i);
-                const v8ui i00 = faces + vIndex*size1 + uIndex;
-                const v8ui ib00 = i00 + 0*size4;
-                const v8sf b00 = gather(base, ib00);
-                const v8sf b01 = gather(base, ib00 + 1);
-                const v8sf b10 = gather(base, ib00 + size1);
-                const v8sf b11 = gather(base, ib00 + size1 + 1);
-                const v8ui ig00 = i00 + 1*size4;
-                const v8sf g00 = gather(base, ig00);
-                const v8sf g01 = gather(base, ig00 + 1);
-                const v8sf g10 = gather(base, ig00 + size1);
-                const v8sf g11 = gather(base, ig00 + size1 + 1);
-                const v8ui ir00 = i00 + 2*size4;
-                const v8sf r00 = gather(base, ir00);
-                const v8sf r01 = gather(base, ir00 + 1);
-                const v8sf r10 = gather(base, ir00 + size1);
-                const v8sf r11 = gather(base, ir00 + size1 + 1);
-                const v8sf fu = u-floor(u);
-                const v8sf fv = v-floor(v);
-                const v8sf w00 = (1-fu)*(1-fv);
-                const v8sf w01 =    fu *(1-fv);
-                const v8sf w10 = (1-fu)*   fv ;
-                const v8sf w11 =    fu *   fv ;
-                const v8sf b = w00 * b00 + w01 * b01 + w10 * b10 + w11 * b11;
-                const v8sf g = w00 * g00 + w01 * g01 + w10 * g10 + w11 * g11;
-                const v8sf r = w00 * r00 + w01 * r01 + w10 * r10 + w11 * r11;
-#endif
-#endif
-                sumB += b;
-                sumG += g;
-                sumR += r;
+            if(mode == AO) { // Independent of emitters (first group)
+                for(uint s=0; s<Lookup::S; s+=8) {
+                    const v8sf t = min(*(v8sf*)(T+s), 1);
+                    sumB[0] += t;
+                    sumG[0] += t;
+                    sumR[0] += t;
+                }
+            } else if(mode == Direct) {
+                for(uint s=0; s<Lookup::S; s+=8) {
+                    const v8si i = *(v8si*)(id+s);
+                    const v8si face = i < intX(scene.size); // Misses (scene.size) and clusters (after) are not faces
+                    const v8si f = blend(_0i, i, face);
+                    const v8sf eB = and(face, gather(scene.emittanceB.data, f));
+                    const v8sf eG = and(face, gather(scene.emittanceG.data, f));
+                    const v8sf eR = and(face, gather(scene.emittanceR.data, f));
+                    const v8si group = (v8si)gather(scene.group.data, f);
+                    for(uint g: range(groupCount)) {
+                        const v8si inGroup = group == intX(g);
+                        sumB[g] += and(inGroup, eB);
+                        sumG[g] += and(inGroup, eG);
+                        sumR[g] += and(inGroup, eR);
+                    }
+                }
+            } else { // Indirect: gathers diffuse radiance of visible texels (published by previous iteration)
+                const float* Sx = lookup.X.data;
+                const float* Sy = lookup.Y.data;
+                const float* Sz = lookup.Z.data;
+                const v8sf Px = float8(P.x), Py = float8(P.y), Pz = float8(P.z);
+                const size_t groupStride = scene.diffuseBasis.size/groupCount;
+                for(uint s=0; s<Lookup::S; s+=8) {
+                    const v8si hit = *(v8si*)(id+s) < intX(scene.size);
+                    if(!::mask(hit)) continue;
+                    const v8si i = blend(_0i, *(v8si*)(id+s), hit); // Misses gather face 0 (masked)
+                    // Lookup directions are sampled in the (T, B, N) frame
+                    const v8sf Lx = *(v8sf*)(Sx+s), Ly = *(v8sf*)(Sy+s), Lz = *(v8sf*)(Sz+s);
+                    const v8sf Dx = Lx*frameT.x + Ly*frameB.x + Lz*N.x;
+                    const v8sf Dy = Lx*frameT.y + Ly*frameB.y + Lz*N.y;
+                    const v8sf Dz = Lx*frameT.z + Ly*frameB.z + Lz*N.z;
+                    v8sf det, U, V;
+                    ::intersect(gather(scene.X0.data, i), gather(scene.Y0.data, i), gather(scene.Z0.data, i),
+                                gather(scene.X1.data, i), gather(scene.Y1.data, i), gather(scene.Z1.data, i),
+                                gather(scene.X2.data, i), gather(scene.Y2.data, i), gather(scene.Z2.data, i),
+                                Px, Py, Pz, Dx, Dy, Dz, det, U, V);
+                    // Barycentric to texel coordinates
+                    const v8sf b1 = min(max(0.f, U/det), 1), b2 = min(max(0.f, V/det), 1-b1), b0 = 1-b1-b2;
+                    const v8ui size1 = gather(scene.size1.data, i);
+                    const v8ui sizeV = gather(scene.V.data, i);
+                    const v8sf u = and(hit, min(max(0.f, b0*gather(scene.U0.data, i) + b1*gather(scene.U1.data, i) + b2*gather(scene.U2.data, i)), toFloat(size1-1)));
+                    const v8sf v = and(hit, min(max(0.f, b0*gather(scene.V0.data, i) + b1*gather(scene.V1.data, i) + b2*gather(scene.V2.data, i)), toFloat(sizeV-1)));
+                    const v8si vIndex = cvtt(v), uIndex = cvtt(u); // Floor
+                    const v8ui faces = gather(scene.diffuseBGR.data, i);
+                    const v8ui size2 = gather(scene.size2.data, i);
+                    const v8ui i00 = faces + vIndex*size1 + uIndex;
+                    const v8sf fu = u-floor(u);
+                    const v8sf fv = v-floor(v);
+                    const v8sf w00 = and(hit, (1-fu)*(1-fv));
+                    const v8sf w01 = and(hit,    fu *(1-fv));
+                    const v8sf w10 = and(hit, (1-fu)*   fv );
+                    const v8sf w11 = and(hit,    fu *   fv );
+                    for(uint g: range(groupCount)) { // Same texels in the basis of each group
+                        const float* const base = scene.diffuseBasis.data + g*groupStride;
+                        const v8ui ib00 = i00 + 0*size2;
+                        const v8sf b00 = gather(base, ib00);
+                        const v8sf b01 = gather(base, ib00 + 1);
+                        const v8sf b10 = gather(base, ib00 + size1);
+                        const v8sf b11 = gather(base, ib00 + size1 + 1);
+                        const v8ui ig00 = i00 + 1*size2;
+                        const v8sf g00 = gather(base, ig00);
+                        const v8sf g01 = gather(base, ig00 + 1);
+                        const v8sf g10 = gather(base, ig00 + size1);
+                        const v8sf g11 = gather(base, ig00 + size1 + 1);
+                        const v8ui ir00 = i00 + 2*size2;
+                        const v8sf r00 = gather(base, ir00);
+                        const v8sf r01 = gather(base, ir00 + 1);
+                        const v8sf r10 = gather(base, ir00 + size1);
+                        const v8sf r11 = gather(base, ir00 + size1 + 1);
+                        sumB[g] += w00 * b00 + w01 * b01 + w10 * b10 + w11 * b11;
+                        sumG[g] += w00 * g00 + w01 * g01 + w10 * g10 + w11 * g11;
+                        sumR[g] += w00 * r00 + w01 * r01 + w10 * r10 + w11 * r11;
+                    }
+                }
+            }
+#if BVH
+            if(clusterError && mode != AO) for(uint s=0; s<Lookup::S; s+=8) { // Aggregated radiance of clusters
+                const v8si i = *(v8si*)(id+s) - intX(scene.size+1);
+                const v8si cluster = i >= _0i;
+                if(!::mask(cluster)) continue;
+                const v8si c = blend(_0i, i, cluster);
+                for(uint g: range(groupCount)) {
+                    const size_t offset = g*8*hierarchy.nodes.size;
+                    sumB[g] += and(cluster, gather(clusterB.data+offset, c));
+                    sumG[g] += and(cluster, gather(clusterG.data+offset, c));
+                    sumR[g] += and(cluster, gather(clusterR.data+offset, c));
+                }
             }
-            out += reflectance * (1.f/(Lookup::S*scene.iterations)) * bgr3f(hsum(sumB), hsum(sumG), hsum(sumR));
+#endif
+            for(uint g: range(groupCount)) out[g] += reflectance * (1.f/Lookup::S) * bgr3f(hsum(sumB[g]), hsum(sumG[g]), hsum(sumR[g]));
         }
 #endif
-        return out;
+    }
+
+    /// Shades \a faceIndex at \a P (light groups recombined with scene gains)
+    inline bgr3f shade(uint faceIndex, const vec3 P, const vec3 D, const vec3 T, const vec3 B, const vec3 N, Random& random) const {
+        bgr3f out[maxGroupCount];
+        shade(faceIndex, P, D, T, B, N, random, out);
+        bgr3f sum = 0;
+        for(uint g: range(scene.groupCount)) sum += scene.gain[g] * out[g];
+        return sum;
     }
 
     inline bgr3f shade(size_t i, const vec3 P, const vec3 D, const float u, const float v, Random& random) const {
@@ -528,4 +1011,14 @@ struct Radiosity {
         const size_t faceIndex = raycast(O, D, t, u, v);
         return t<inff ? shade(faceIndex, O+t*D, D, u, v, random) : 0;
     }
+
+    /// Shades a packet of 8 coherent rays from a common origin (e.g 2×4 primary rays)
+    inline void raycast_shade(const vec3 O, const v8sf Dx, const v8sf Dy, const v8sf Dz, Random& random, bgr3f color[8]) const {
+        v8sf t, u, v;
+        const v8ui faceIndex = raycast(float8(O.x), float8(O.y), float8(O.z), Dx, Dy, Dz, t, u, v);
+        for(uint k: range(8)) {
+            const vec3 D (Dx[k], Dy[k], Dz[k]);
+            color[k] = t[k]<inff ? shade(faceIndex[k], O+t[k]*D, D, u[k], v[k], random) : 0;
+        }
+    }
 };
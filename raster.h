@@ -28,12 +28,16 @@ template<int C> struct Tile { // 64KB framebuffer (L1)
     v16sf pixelZ[4*4], pixels[C][4*4];
     v16sf sampleZ[16*16], samples[C][16*16];
     mask16 multisample[16]; // Per-pixel flag to trigger multisample operations
+    float maxZ; // Farthest depth (conservative bound for hierarchical Z culling)
     bool needClear;
     Tile();
 };
 
 /// Tiled render target
-template<int C> struct RenderTarget {
+/// \param S Samples per pixel side (MSAA rate S²: 1×, 4×, 16×)
+/// \note Tiles are 64×64 samples for any rate: (64/S)² pixels (each 4×4 samples cell holds (4/S)² pixels)
+template<int C, int S = 4> struct RenderTarget {
+    static_assert(S == 1 || S == 2 || S == 4, "");
     int2 size = 0; // Pixels
     uint width = 0, height = 0; // Tiles
     buffer<Tile<C>> tiles;
@@ -43,8 +47,8 @@ template<int C> struct RenderTarget {
     void setup(int2 size, float clearZ, float clear[C]) {
         if(this->size != size) {
             this->size = size;
-            width = align(64,size.x*4)/64;
-            height = align(64,size.y*4)/64;
+            width = align(64,size.x*S)/64;
+            height = align(64,size.y*S)/64;
             tiles = buffer<Tile<C>>(width*height);
         }
         this->clearZ = clearZ;
@@ -52,13 +56,70 @@ template<int C> struct RenderTarget {
         for(Tile<C>& tile: tiles) { tile.needClear = true; } // Forces initial background blit to target
     }
 
+    /// Resolved (average of multisampled) pixels of 4×4 pixels block \a blockI of \a tile (S = 4)
+    void resolveBlock(const Tile<C>& tile, const uint blockI, v16sf pixels[C]) const {
+        static constexpr v16si pixelSeq {v8si{(4*4)*0,(4*4)*1,(4*4)*2,(4*4)*3,(4*4)*4,(4*4)*5,(4*4)*6,(4*4)*7},v8si{(4*4)*8,(4*4)*9,(4*4)*10,(4*4)*11,(4*4)*12,(4*4)*13,(4*4)*14,(4*4)*15}};
+        const uint blockPtr = blockI*(4*4);
+        const mask16 multisample = tile.multisample[blockI];
+        if(!multisample) { // No multisampled pixel in block => Directly load block without any multisampled pixels to blend
+            for(uint c: range(C)) pixels[c] = tile.pixels[c][blockI];
+        } else {
+            // Resolves (average samples of) multisampled pixels
+            for(uint c: range(C)) {
+                v16sf sum = v16sf(0);
+                for(uint sampleI: range(4*4)) sum += gather((float*)(tile.samples[c]+blockPtr)+sampleI, pixelSeq);
+                const v16sf scale = v16sf(1./(4*4));
+                pixels[c] = blend(tile.pixels[c][blockI], scale*sum, mask(multisample));
+            }
+        }
+    }
+    /// Resolved depth and color of pixel (\a x, \a y) of \a tile (S < 4)
+    void resolvePixel(const Tile<C>& tile, const uint x, const uint y, float& z, float pixel[C]) const {
+        const uint cellSize = 4/S;
+        const uint cellX = x/cellSize, cellY = y/cellSize;
+        const uint cellPtr = ((cellY/4)*4+cellX/4)*(4*4) + (cellY%4)*4+cellX%4;
+        if(tile.needClear) { // Empty
+            z = clearZ;
+            for(uint c: range(C)) pixel[c] = clear[c];
+        } else if(!(tile.multisample[cellPtr/16]&(1<<(cellPtr%16)))) { // Uniform cell
+            z = ((float*)tile.pixelZ)[cellPtr];
+            for(uint c: range(C)) pixel[c] = ((float*)tile.pixels[c])[cellPtr];
+        } else { // Averages samples of pixel
+            z = 0;
+            for(uint c: range(C)) pixel[c] = 0;
+            for(uint sy: range(S)) for(uint sx: range(S)) {
+                const uint sampleI = ((y%cellSize)*S+sy)*4 + (x%cellSize)*S+sx;
+                z += tile.sampleZ[cellPtr][sampleI];
+                for(uint c: range(C)) pixel[c] += tile.samples[c][cellPtr][sampleI];
+            }
+            const float scale = 1.f/(S*S);
+            z *= scale;
+            for(uint c: range(C)) pixel[c] *= scale;
+        }
+    }
+
     // Resolves internal MSAA linear framebuffer to linear half buffers
     void resolve(const ImageH& Z, const ImageH targets[C]);
+    /// Resolves, scales by \a exposure and encodes to sRGB BGRA 8bit \a target in a single pass (B, G, R channels)
+    void resolve(const Image& target, const float exposure = 1);
 };
 
 // Untiles render buffer, resolves (average samples of) multisampled pixels, and converts to half floats (linear RGB)
-template<int C> void RenderTarget<C>::resolve(const ImageH& Z, const ImageH targets[C]) {
-    if(Z) {
+template<int C, int S> void RenderTarget<C, S>::resolve(const ImageH& Z, const ImageH targets[C]) {
+    if(S < 4) { // Several pixels per 4×4 samples cell
+        const uint tileSize = 64/S;
+        for(uint tileY: range(height)) for(uint tileX: range(width)) {
+            const Tile<C>& tile = tiles[tileY*width+tileX];
+            for(uint y: range(tileSize)) for(uint x: range(tileSize)) {
+                const uint targetX = tileX*tileSize+x, targetY = tileY*tileSize+y;
+                if(targetX >= uint(size.x) || targetY >= uint(size.y)) continue;
+                float z, pixel[C];
+                resolvePixel(tile, x, y, z, pixel);
+                if(Z) Z[targetY*Z.stride+targetX] = z;
+                for(uint c: range(C)) targets[c][targetY*targets[c].stride+targetX] = pixel[c];
+            }
+        }
+    } else if(Z) {
         const uint stride = Z.stride;
         static constexpr v16si pixelSeq {v8si{(4*4)*0,(4*4)*1,(4*4)*2,(4*4)*3,(4*4)*4,(4*4)*5,(4*4)*6,(4*4)*7},v8si{(4*4)*8,(4*4)*9,(4*4)*10,(4*4)*11,(4*4)*12,(4*4)*13,(4*4)*14,(4*4)*15}};
         for(uint tileY: range(height)) for(uint tileX: range(width)) {
@@ -112,7 +173,6 @@ template<int C> void RenderTarget<C>::resolve(const ImageH& Z, const ImageH targ
         }
     } else { // Specific path without Z
         const uint stride = targets[0].stride;
-        static constexpr v16si pixelSeq {v8si{(4*4)*0,(4*4)*1,(4*4)*2,(4*4)*3,(4*4)*4,(4*4)*5,(4*4)*6,(4*4)*7},v8si{(4*4)*8,(4*4)*9,(4*4)*10,(4*4)*11,(4*4)*12,(4*4)*13,(4*4)*14,(4*4)*15}};
         for(uint tileY: range(height)) for(uint tileX: range(width)) {
             Tile<C>& tile = tiles[tileY*width+tileX];
             uint const targetTilePtr = tileY*16*stride + tileX*16;
@@ -122,20 +182,8 @@ template<int C> void RenderTarget<C>::resolve(const ImageH& Z, const ImageH targ
             }
             for(uint blockY: range(4)) for(uint blockX: range(4)) {
                 const uint blockI = blockY*4+blockX;
-                const uint blockPtr = blockI*(4*4);
                 v16sf pixels[C];
-                const mask16 multisample = tile.multisample[blockI];
-                if(!multisample) { // No multisampled pixel in block => Directly load block without any multisampled pixels to blend
-                    for(uint c: range(C)) pixels[c] = tile.pixels[c][blockI];
-                } else {
-                    // Resolves (average samples of) multisampled pixels
-                    for(uint c: range(C)) {
-                        v16sf sum = v16sf(0);
-                        for(uint sampleI: range(4*4)) sum += gather((float*)(tile.samples[c]+blockPtr)+sampleI, pixelSeq);
-                        const v16sf scale = v16sf(1./(4*4));
-                        pixels[c] = blend(tile.pixels[c][blockI], scale*sum, mask(multisample));
-                    }
-                }
+                resolveBlock(tile, blockI, pixels);
                 // Converts to half and untiles block of pixels
                 const uint targetBlockPtr = targetTilePtr+blockY*4*stride+blockX*4;
                 for(uint c: range(C)) {
@@ -149,6 +197,60 @@ template<int C> void RenderTarget<C>::resolve(const ImageH& Z, const ImageH targ
     }
 }
 
+// Untiles render buffer, resolves multisampled pixels, scales by exposure and encodes to sRGB (fused, without intermediate planes)
+template<int C, int S> void RenderTarget<C, S>::resolve(const Image& target, const float exposure) {
+    static_assert(C == 3, "B, G, R");
+    extern uint8 sRGB_forward[0x1000];
+    const uint stride = target.stride;
+    const float scale = exposure*0xFFF;
+    // Clamps to sRGB table index (NaN to 0) before conversion (out of range float to integer conversion is undefined)
+    auto quantize = [scale](const float x) { const float y = scale*x; return y > 0 ? uint(::min(y, float(0xFFF))) : 0u; };
+    if(S < 4) { // Several pixels per 4×4 samples cell
+        const uint tileSize = 64/S;
+        for(uint tileY: range(height)) for(uint tileX: range(width)) {
+            const Tile<C>& tile = tiles[tileY*width+tileX];
+            for(uint y: range(tileSize)) for(uint x: range(tileSize)) {
+                const uint targetX = tileX*tileSize+x, targetY = tileY*tileSize+y;
+                if(targetX >= uint(size.x) || targetY >= uint(size.y)) continue;
+                float z, pixel[C];
+                resolvePixel(tile, x, y, z, pixel);
+                uint bgr[C];
+                for(uint c: range(C)) bgr[c] = quantize(pixel[c]);
+                target[targetY*stride+targetX] = byte4(sRGB_forward[bgr[0]], sRGB_forward[bgr[1]], sRGB_forward[bgr[2]], 0xFF);
+            }
+        }
+        return;
+    }
+    const v8sf scale8 = float8(scale);
+    for(uint tileY: range(height)) for(uint tileX: range(width)) {
+        const Tile<C>& tile = tiles[tileY*width+tileX];
+        uint const targetTilePtr = tileY*16*stride + tileX*16;
+        if(tile.needClear) { // Empty
+            uint bgr[C];
+            for(uint c: range(C)) bgr[c] = quantize(clear[c]);
+            const byte4 sRGB (sRGB_forward[bgr[0]], sRGB_forward[bgr[1]], sRGB_forward[bgr[2]], 0xFF);
+            for(uint y: range(16)) for(uint x: range(16)) target[targetTilePtr+y*stride+x] = sRGB;
+            continue;
+        }
+        for(uint blockY: range(4)) for(uint blockX: range(4)) {
+            const uint blockI = blockY*4+blockX;
+            v16sf pixels[C];
+            resolveBlock(tile, blockI, pixels);
+            // Scales, quantizes to sRGB table index (clamps, NaN to 0), encodes and untiles block of pixels
+            v8si bgr[C][2];
+            for(uint c: range(C)) {
+                bgr[c][0] = cvtt(::min(::max(scale8*pixels[c].r1, float8(0)), float8(0xFFF)));
+                bgr[c][1] = cvtt(::min(::max(scale8*pixels[c].r2, float8(0)), float8(0xFFF)));
+            }
+            const uint targetBlockPtr = targetTilePtr+blockY*4*stride+blockX*4;
+            for(uint pixelI: range(4*4)) {
+                const uint h = pixelI/8, lane = pixelI%8;
+                target[targetBlockPtr+(pixelI/4)*stride+pixelI%4] = byte4(sRGB_forward[bgr[0][h][lane]], sRGB_forward[bgr[1][h][lane]], sRGB_forward[bgr[2][h][lane]], 0xFF);
+            }
+        }
+    }
+}
+
 // 4×4 xy steps constant mask for the 4 possible reject corner
 static const v16sf X[4] = {
     {0,1,2,3,
@@ -190,7 +292,8 @@ static const v16sf Y[4] = {
 static const v16sf X0s = ::X[0]+v16sf(1./2);
 static const v16sf Y0s = ::Y[0]+v16sf(1./2);
 
-template<class Shader> struct RenderPass {
+/// \param S Samples per pixel side (MSAA rate S²) (see RenderTarget)
+template<class Shader, int S = 4> struct RenderPass {
     // Shading parameters
     typedef typename Shader::FaceAttributes FaceAttributes;
     static constexpr int V = Shader::V;
@@ -204,20 +307,35 @@ template<class Shader> struct RenderPass {
         vec2 edges[3]; // triangle edge equations
         float binReject[3], binAccept[3]; // Initial distance step at a bin reject/accept corner
         vec3 Eiw, Ez; // Linearly interpolated attributes (1/w, z)
+        float minZ; // Nearest vertex depth (-inf when a vertex is behind the eye) (hierarchical Z culling)
         vec3 varyings[V]; // Varying (perspective-interpolated (E/w)) vertex attributes
         FaceAttributes faceAttributes; // Custom constant face attributes
     };
-    uint faceCapacity;
-    buffer<Face> faces=0;
+    buffer<Face> faces=0; // Grows on overflow (capacity is kept across frames)
     uint faceCount=0;
 
     // Bins to sort faces
     uint width, height; // Tiles
+    static constexpr uint none = ~0u;
+    struct Chunk { // 256B
+        static constexpr uint capacity = 62;
+        uint next = none; // Next chunk of the bin
+        uint faceCount = 0;
+        uint faces[capacity];
+    };
+    array<Chunk> chunks; // Per-frame arena of bin chunks (cleared by setup, capacity is kept across frames)
     struct Bin {
-        uint16 faceCount = 0;
-        uint16 faces[13318];
+        uint faceCount = 0;
+        uint first = none, last = none; // Linked list of chunks
     };
     buffer<Bin> bins=0;
+    // Per job bin fragments of parallel submission (merged in submission order)
+    buffer<buffer<Bin>> fragmentBins;
+    buffer<array<Chunk>> fragmentChunks;
+
+    // Hierarchical Z culling
+    bool hiZ = true; // Rejects faces (per tile) and 4×4 pixel blocks whose nearest depth is behind the farthest depth of the tile or block
+    struct HiZCounters { uint64 faces=0, faceRejects=0, blocks=0, blockRejects=0; } hiZCounters; // Tested and rejected faces (per tile) and blocks (reset by setup)
 
     // Profiling counters
     profile(int64 rasterTime=0; int64 pixelTime=0; int64 sampleTime=0; int64 sampleFirstTime=0; int64 sampleOverTime=0;)
@@ -225,29 +343,99 @@ template<class Shader> struct RenderPass {
 
     RenderPass(const Shader& shader) : shader(shader) {}
     /// Resets bins and faces for a new setup.
-    template<int C> void setup(const RenderTarget<C>& target, uint faceCapacity) {
+    /// \param faceCapacity Expected face count (preallocates, submit grows on overflow)
+    template<int C> void setup(const RenderTarget<C, S>& target, uint faceCapacity) {
         assert_(target.size);
         if(width != target.width || height != target.height) {
             width = target.width, height = target.height;
             bins = buffer<Bin>(width*height);
         }
-        if(this->faceCapacity != faceCapacity) {
-            if(faceCapacity>65536) { error("Too many faces",faceCapacity); return; }
-            this->faceCapacity = faceCapacity;
-            faces = buffer<Face>(this->faceCapacity);
-        }
+        if(faces.capacity < faceCapacity) faces = buffer<Face>(faceCapacity);
         bins.clear();
+        chunks.clear();
         faceCount=0;
+        hiZCounters = {};
     }
 
     // Implementation is inline to allow per-pass face attributes specialization and inline shader calls
 
+    /// Grows face storage to at least \a capacity faces (keeps submitted faces)
+    void reserve(size_t capacity) {
+        if(capacity <= faces.capacity) return;
+        buffer<Face> faces (capacity);
+        faces.slice(0, faceCount).copy(this->faces.slice(0, faceCount));
+        this->faces = ::move(faces);
+    }
+
+    /// Appends \a faceIndex to \a bin (links a new chunk from \a chunks when full)
+    static void append(Bin& bin, array<Chunk>& chunks, uint faceIndex) {
+        if(bin.last == none || chunks[bin.last].faceCount == Chunk::capacity) {
+            const uint chunk = chunks.size;
+            chunks.append();
+            if(bin.last == none) bin.first = chunk; else chunks[bin.last].next = chunk;
+            bin.last = chunk;
+        }
+        Chunk& chunk = chunks[bin.last];
+        chunk.faces[chunk.faceCount++] = faceIndex;
+        bin.faceCount++;
+    }
+
     /// Submits triangles for binning, actual rendering is deferred until render
     /// \note Device coordinates are not normalized, positions should be in [0..4·Width],[0..4·Height]
     /// \note Accepts CW winding in the left-handed coordinates system (Z-) i.e CCW winding in original right-handed system
     void submit(vec4 A, vec4 B, vec4 C, const vec3 vertexAttributes[V], FaceAttributes faceAttributes) {
-        if(faceCount>=faceCapacity) { error("Face overflow"_); return; }
-        Face& face = faces[faceCount];
+        if(faceCount>=faces.capacity) reserve(::max(2*faces.capacity, size_t(1024))); // Amortized
+        setup(faceCount, A, B, C, vertexAttributes, faceAttributes, bins, chunks);
+        faceCount++;
+    }
+
+    /// Sets up and bins \a count faces in parallel jobs, then merges per job bin fragments in submission order (deterministic depth ties)
+    /// \param face(index, A, B, C, vertexAttributes, faceAttributes) returns whether face \a index is submitted (false: culled)
+    /// \note Culled faces leave an unused slot (face indices match submission indices)
+    template<Type F> void submit(uint count, F face) {
+        if(!count) return;
+        const uint base = faceCount;
+        reserve(base+count);
+        const uint jobCount = ::min(uint(threadCount()), count);
+        if(fragmentBins.size != jobCount) {
+            fragmentBins = buffer<buffer<Bin>>(jobCount); fragmentBins.clear();
+            fragmentChunks = buffer<array<Chunk>>(jobCount); fragmentChunks.clear();
+        }
+        parallel_for(0, jobCount, [this, base, count, jobCount, &face](uint, uint job) {
+            buffer<Bin>& bins = fragmentBins[job];
+            array<Chunk>& chunks = fragmentChunks[job];
+            if(bins.size != width*height) bins = buffer<Bin>(width*height);
+            bins.clear();
+            chunks.clear();
+            for(uint index: range(uint(uint64(job)*count/jobCount), uint(uint64(job+1)*count/jobCount))) {
+                vec4 A, B, C; vec3 vertexAttributes[V]; FaceAttributes faceAttributes;
+                if(face(index, A, B, C, vertexAttributes, faceAttributes)) setup(base+index, A, B, C, vertexAttributes, faceAttributes, bins, chunks);
+            }
+        });
+        faceCount = base+count;
+        // Merges fragments (concatenates chunk lists of each bin in job order)
+        uint offsets[jobCount];
+        for(uint job: range(jobCount)) {
+            offsets[job] = chunks.size;
+            const array<Chunk>& fragment = fragmentChunks[job];
+            chunks.append(ref<Chunk>(fragment));
+            for(Chunk& chunk: chunks.slice(offsets[job])) if(chunk.next != none) chunk.next += offsets[job];
+        }
+        for(uint binIndex: range(width*height)) {
+            Bin& bin = bins[binIndex];
+            for(uint job: range(jobCount)) {
+                const Bin& fragment = fragmentBins[job][binIndex];
+                if(fragment.first == none) continue;
+                if(bin.last == none) bin.first = offsets[job]+fragment.first; else chunks[bin.last].next = offsets[job]+fragment.first;
+                bin.last = offsets[job]+fragment.last;
+                bin.faceCount += fragment.faceCount;
+            }
+        }
+    }
+
+    /// Computes edge equations, step grids and varyings of face \a faceIndex and bins it in \a bins (using \a chunks)
+    void setup(uint faceIndex, vec4 A, vec4 B, vec4 C, const vec3 vertexAttributes[V], FaceAttributes faceAttributes, mref<Bin> bins, array<Chunk>& chunks) {
+        Face& face = faces[faceIndex];
         mat3 M = mat3(vec3(A.xy()/A.w, 1), vec3(B.xy()/B.w, 1), vec3(C.xy()/C.w, 1));
         // E = E.cofactor(); // Edge equations are now columns of E
         // Specialization without multiplications by 1s :
@@ -296,28 +484,68 @@ template<class Shader> struct RenderPass {
                 face.binReject[1] + dot(face.edges[1], binXY) >= 0 ||
                 face.binReject[2] + dot(face.edges[2], binXY) >= 0) continue;
 
-            Bin& bin = bins[binY*width+binX];
-            if(bin.faceCount>=sizeof(bin.faces)/sizeof(uint16)) { error("Index overflow"); return; }
-            bin.faces[bin.faceCount++] = faceCount;
+            append(bins[binY*width+binX], chunks, faceIndex);
         }
 
-        const float S = E(2,0)+E(2,1)+E(2,2); // Normalization factor (area)
+        const float area = E(2,0)+E(2,1)+E(2,2); // Normalization factor
         vec3 iw = vec3(1./A.w, 1./B.w, 1./C.w);
         face.Eiw = E*iw; // No normalization required as factor is eliminated by division (Ev/Eiw)
-        face.Ez = E*(vec3(A.z/A.w, B.z/B.w, C.z/C.w)/S); // Normalization required as z is the direct end result
+        face.Ez = E*(vec3(A.z/A.w, B.z/B.w, C.z/C.w)/area); // Normalization required as z is the direct end result
+        face.minZ = A.w > 0 && B.w > 0 && C.w > 0 ? ::min(::min(A.z/A.w, B.z/B.w), C.z/C.w) : -inff; // z is linear in screen space
         for(uint i: range(V)) face.varyings[i] = E*(vertexAttributes[i]*iw);
         face.faceAttributes = faceAttributes;
+    }
 
-        faceCount++;
+    /// Draws \a coverage samples of a cell of 4×4 samples holding (4/S)² pixels (S < 4)
+    /// Expands uniform cell on first write, depth tests each sample and shades once per pixel (at pixel center)
+    template<int C> void drawCell(const uint id, Tile<C>& tile, const Face& face, const uint cellPtr, const vec2 cellXY, const v16si coverage) {
+        // Sample centers
+        const v16sf sampleX = v16sf(cellXY.x) + X0s, sampleY = v16sf(cellXY.y) + Y0s;
+        const v16sf z = v16sf(face.Ez.x)*sampleX + v16sf(face.Ez.y)*sampleY + v16sf(face.Ez.z);
+        v16sf& sampleZ = tile.sampleZ[cellPtr];
+        if(!(tile.multisample[cellPtr/16]&(1<<(cellPtr%16)))) { // Expands uniform cell
+            tile.multisample[cellPtr/16] |= (1<<(cellPtr%16));
+            sampleZ = v16sf(((float*)tile.pixelZ)[cellPtr]);
+            for(uint c: range(C)) tile.samples[c][cellPtr] = v16sf(((float*)tile.pixels[c])[cellPtr]);
+        }
+        const v16si visibleMask = coverage & (z <= sampleZ) & (z >= v16sf(-1));
+        if(!::mask(visibleMask)) return;
+        store(sampleZ, visibleMask, z);
+        ((float*)tile.pixelZ)[cellPtr] = hmax(sampleZ); // Keeps pixelZ as farthest depth of expanded cell (hierarchical Z)
+        // Pixel centers (shading rate)
+        static const v16sf pixelX0 = v16sf(S)*floor(X[0]*v16sf(1.f/S)) + v16sf(S/2.f);
+        static const v16sf pixelY0 = v16sf(S)*floor(Y[0]*v16sf(1.f/S)) + v16sf(S/2.f);
+        const v16sf pixelX = v16sf(cellXY.x) + pixelX0, pixelY = v16sf(cellXY.y) + pixelY0;
+        const v16sf w = 1/(v16sf(face.Eiw.x)*pixelX + v16sf(face.Eiw.y)*pixelY + v16sf(face.Eiw.z));
+        const v16sf pixelZ = v16sf(face.Ez.x)*pixelX + v16sf(face.Ez.y)*pixelY + v16sf(face.Ez.z);
+        v16sf varyings[V];
+        for(int i: range(V)) varyings[i] = w*(v16sf(face.varyings[i].x)*pixelX + v16sf(face.varyings[i].y)*pixelY + v16sf(face.varyings[i].z));
+        Vec<v16sf, C> src = shader.template shade(id, face.faceAttributes, pixelZ, varyings, visibleMask);
+        for(uint c: range(C)) store(tile.samples[c][cellPtr], visibleMask, src._[c]);
     }
 
     /// Renders one tile
     template<int C> void render(const uint id, Tile<C>& tile, const Bin& bin, const vec2 binXY) {
+        HiZCounters counters;
         // Loops on all faces in the bin
-        for(uint16 faceIndex: ref<uint16>(bin.faces, bin.faceCount)) {
+        for(uint chunk = bin.first; chunk != none; chunk = chunks[chunk].next) for(uint faceIndex: ref<uint>(chunks[chunk].faces, chunks[chunk].faceCount)) {
             struct DrawBlock { vec2 pos; uint blockIndex; mask16 mask; } blocks[4*4]; uint blockCount=0;
             struct DrawPixel { v16si mask; vec2 pos; uint ptr; } pixels[16*16]; uint pixelCount=0;
             const Face& face = faces[faceIndex];
+            if(hiZ) {
+                counters.faces++;
+                if(face.minZ > tile.maxZ) { counters.faceRejects++; continue; } // Occluded within tile
+            }
+            // Whether nearest depth of face within block (plane minimum at block corners) is behind farthest depth of block
+            // (Multisampled pixels keep pixelZ as a bound of their samples)
+            auto occluded = [&](uint blockI, vec2 blockXY) {
+                if(!hiZ) return false;
+                counters.blocks++;
+                const float minZ = ::max(face.minZ, face.Ez.z + face.Ez.x*(blockXY.x + (face.Ez.x<0 ? 16 : 0)) + face.Ez.y*(blockXY.y + (face.Ez.y<0 ? 16 : 0)));
+                if(minZ <= hmax(tile.pixelZ[blockI])) return false;
+                counters.blockRejects++;
+                return true;
+            };
             {
                 profile( int64 start=readCycleCounter(); );
                 float binReject[3], binAccept[3];
@@ -330,8 +558,8 @@ template<class Shader> struct RenderPass {
                 if( binAccept[0] < 0 && binAccept[1] < 0 && binAccept[2] < 0 ) {
                     v16sf blockX = v16sf(binXY.x)+v16sf(16)*X[0];
                     v16sf blockY = v16sf(binXY.y)+v16sf(16)*Y[0];
-                    for(;blockCount<16;blockCount++)
-                        blocks[blockCount] = DrawBlock{vec2(blockX[blockCount], blockY[blockCount]), blockCount, 0xFFFF};
+                    for(uint blockI: range(4*4)) if(!occluded(blockI, vec2(blockX[blockI], blockY[blockI])))
+                        blocks[blockCount++] = DrawBlock{vec2(blockX[blockI], blockY[blockI]), blockI, 0xFFFF};
                 } else {
                     v16sf blockX = v16sf(binXY.x)+v16sf(16)*X[0];
                     v16sf blockY = v16sf(binXY.y)+v16sf(16)*Y[0];
@@ -343,6 +571,7 @@ template<class Shader> struct RenderPass {
                         if((blockReject[0] >= 0) || (blockReject[1] >= 0) || (blockReject[2] >= 0) ) continue;
 
                         const vec2 blockXY (blockX[blockI], blockY[blockI]);
+                        if(occluded(blockI, blockXY)) continue;
 
                         float blockAccept[3]; for(int e: range(3)) blockAccept[e] = binAccept[e] + face.blockAcceptStep[e][blockI];
                         // Full block accept
@@ -394,7 +623,18 @@ template<class Shader> struct RenderPass {
                 }
                 profile( rasterTime += readCycleCounter()-start; )
             }
-            {
+            if(S < 4) { // Shades each pixel of covered cells (depth tests each sample)
+                profile( int64 start = readCycleCounter(); )
+                for(const DrawBlock& draw: ref<DrawBlock>(blocks, blockCount)) { // Blocks of fully covered cells
+                    const v16sf cellX = v16sf(draw.pos.x) + v16sf(4)*X[0];
+                    const v16sf cellY = v16sf(draw.pos.y) + v16sf(4)*Y[0];
+                    for(uint pixelI: range(4*4)) if(draw.mask&(1<<pixelI))
+                        drawCell(id, tile, face, draw.blockIndex*(4*4)+pixelI, vec2(cellX[pixelI], cellY[pixelI]), ::mask(mask16(0xFFFF)));
+                }
+                for(const DrawPixel& draw: ref<DrawPixel>(pixels, pixelCount)) drawCell(id, tile, face, draw.ptr, draw.pos, draw.mask); // Partially covered cells
+                profile( pixelTime += readCycleCounter()-start; )
+            }
+            if(S == 4) {
                 profile( int64 start = readCycleCounter(); /*int64 userTime=0;*/ )
                 for(const DrawBlock& draw: ref<DrawBlock>(blocks, blockCount)) { // Blocks of fully covered pixels
                     const uint blockIndex = draw.blockIndex;
@@ -454,7 +694,7 @@ template<class Shader> struct RenderPass {
                 }
                 profile( pixelTime += readCycleCounter()-start; )
             }
-            {
+            if(S == 4) {
                 profile( int64 start = readCycleCounter(); )
                 for(uint i: range(pixelCount)) { // Partially covered pixel of samples
                     const DrawPixel& draw = pixels[i];
@@ -520,12 +760,23 @@ template<class Shader> struct RenderPass {
                 }
                 profile( sampleTime += readCycleCounter()-start; )
             }
+            if(hiZ && (blockCount || pixelCount)) { // Updates farthest depth of tile
+                v16sf maxZ = tile.pixelZ[0];
+                for(uint blockI: range(1, 4*4)) maxZ = max(maxZ, tile.pixelZ[blockI]);
+                tile.maxZ = hmax(maxZ);
+            }
+        }
+        if(hiZ) {
+            __sync_add_and_fetch(&hiZCounters.faces, counters.faces);
+            __sync_add_and_fetch(&hiZCounters.faceRejects, counters.faceRejects);
+            __sync_add_and_fetch(&hiZCounters.blocks, counters.blocks);
+            __sync_add_and_fetch(&hiZCounters.blockRejects, counters.blockRejects);
         }
     }
 
     /// Renders all tiles
     // For each bin, rasterizes and shades all triangles
-    template<int C> void render(RenderTarget<C>& target) {
+    template<int C> void render(RenderTarget<C, S>& target) {
         assert_(width == target.width && height == target.height);
         if(!bins || !faces) return;
         //for(uint binIndex: range(width*height)) {
@@ -537,6 +788,7 @@ template<class Shader> struct RenderPass {
                 mref<uint16>(tile.multisample).clear();
                 mref<v16sf>(tile.pixelZ).clear(v16sf(target.clearZ));
                 for(int c: range(C)) mref<v16sf>(tile.pixels[c]).clear(v16sf(target.clear[c]));
+                tile.maxZ = target.clearZ;
                 tile.needClear = false;
             }
 
@@ -1,6 +1,32 @@
 #pragma once
 #include "raster.h"
 
+/// Vertex attributes a shader may declare as varyings (in the order of its varying array)
+struct Varying {
+    enum Attribute { U, V, X, Y, Z, TX, TY, TZ, BX, BY, BZ, NX, NY, NZ };
+    /// Attribute \a a of the 3 vertices of \a face
+    static inline vec3 load(const Scene& scene, const uint face, const Attribute a) {
+        switch(a) {
+            case U: return vec3(scene.U0[face],scene.U1[face],scene.U2[face]);
+            case V: return vec3(scene.V0[face],scene.V1[face],scene.V2[face]);
+            case X: return vec3(scene.X0[face],scene.X1[face],scene.X2[face]);
+            case Y: return vec3(scene.Y0[face],scene.Y1[face],scene.Y2[face]);
+            case Z: return vec3(scene.Z0[face],scene.Z1[face],scene.Z2[face]);
+            case TX: return vec3(scene.TX0[face],scene.TX1[face],scene.TX2[face]);
+            case TY: return vec3(scene.TY0[face],scene.TY1[face],scene.TY2[face]);
+            case TZ: return vec3(scene.TZ0[face],scene.TZ1[face],scene.TZ2[face]);
+            case BX: return vec3(scene.BX0[face],scene.BX1[face],scene.BX2[face]);
+            case BY: return vec3(scene.BY0[face],scene.BY1[face],scene.BY2[face]);
+            case BZ: return vec3(scene.BZ0[face],scene.BZ1[face],scene.BZ2[face]);
+            case NX: return vec3(scene.NX0[face],scene.NX1[face],scene.NX2[face]);
+            case NY: return vec3(scene.NY0[face],scene.NY1[face],scene.NY2[face]);
+            case NZ: return vec3(scene.NZ0[face],scene.NZ1[face],scene.NZ2[face]);
+        }
+        error(int(a));
+    }
+};
+
+/// \note Derived shaders declare consumed vertex attributes: static constexpr Varying::Attribute attributes[V]
 template<int C_, int V_, Type D> struct Shader {
     static constexpr int C = C_;
     static constexpr int V = V_;
@@ -20,56 +46,75 @@ template<int C_, int V_, Type D> struct Shader {
 };
 
 struct TextureShader : Shader<3, 2, TextureShader> {
+    static constexpr Varying::Attribute attributes[V] = {Varying::U, Varying::V};
     const Scene& scene;
+    bool diffuse = false; // Samples view independent (average s,t) texture (low detail)
     TextureShader(const Scene& scene) : scene(scene) {}
 
-    inline Vec<v16sf, C> shade(const uint id, FaceAttributes face, v16sf z, v16sf varying[V], v16si mask) const { return Shader::shade(id, face, z, varying, mask); }
+    inline Vec<v16sf, C> shade(const uint, FaceAttributes face, v16sf, v16sf varying[V], v16si mask) const {
+        Vec<v16sf, 3> Y;
+        const mask16 lanes = ::mask(mask);
+        // Samples each 8 lanes half (skips empty halves)
+        if(lanes&0x00FF) {
+            if(diffuse) sampleDiffuse(scene, face, varying[0].r1, varying[1].r1, Y._[0].r1, Y._[1].r1, Y._[2].r1);
+            else sample(scene, face, varying[0].r1, varying[1].r1, Y._[0].r1, Y._[1].r1, Y._[2].r1);
+        }
+        if(lanes&0xFF00) {
+            if(diffuse) sampleDiffuse(scene, face, varying[0].r2, varying[1].r2, Y._[0].r2, Y._[1].r2, Y._[2].r2);
+            else sample(scene, face, varying[0].r2, varying[1].r2, Y._[0].r2, Y._[1].r2, Y._[2].r2);
+        }
+        return Y;
+    }
     inline Vec<float, 3> shade(const uint, FaceAttributes face, float, float varying[V]) const {
-        bgr3f bgr = sample(scene, face, varying[0],  varying[1]);
+        bgr3f bgr = diffuse ? sampleDiffuse(scene, face, varying[0],  varying[1]) : sample(scene, face, varying[0],  varying[1]);
         return {{bgr.b, bgr.g, bgr.r}};
     }
 };
 
-template<Type Shader> struct Rasterizer {
+/// \param S Samples per pixel side (MSAA rate S²: 1× preview, 4×, 16× stills)
+template<Type Shader, int S = 4> struct Rasterizer {
     Shader shader; // Instance holds any uniforms (currently none)
-    RenderPass<Shader> pass; // Face bins
-    RenderTarget<Shader::C> target; // Sample tiles
+    RenderPass<Shader, S> pass; // Face bins
+    RenderTarget<Shader::C, S> target; // Sample tiles
     Rasterizer(Shader&& shader_={}) : shader(::move(shader_)), pass(shader) {}
 };
 
-template<Type Shader, Type... Args>
-void rasterize(Rasterizer<Shader>& renderer, const Scene& scene, mat4 M, float clear[/*sizeof...(Args)*/], const ImageH& depth, const Args&... targets_) {
-    const ImageH targets[sizeof...(Args)] { unsafeShare(targets_)... }; // Zero-length arrays are not permitted in C++
-    uint2 size = (sizeof...(Args) ? targets[0] : depth).size;
+/// Sets up render target and pass, bins and renders all faces of \a scene (without resolve)
+template<Type Shader, int S>
+void draw(Rasterizer<Shader, S>& renderer, const Scene& scene, mat4 M, float clear[], uint2 size) {
     renderer.target.setup(int2(size), 1, clear); // Needs to be setup before pass
     renderer.pass.setup(renderer.target, scene.size); // Clears bins face counter
     mat4 NDC;
-    NDC.scale(vec3(vec2(size*4u)/2.f, 1)); // 0, 2 -> subsample size // *4u // MSAA->4x
+    NDC.scale(vec3(vec2(size*uint(S))/2.f, 1)); // 0, 2 -> subsample size (S×S samples per pixel)
     NDC.translate(vec3(vec2(1), 0.f)); // -1, 1 -> 0, 2
     M = NDC * M;
-    for(size_t face : range(scene.size)) {
+    static_assert(sizeof(Shader::attributes)/sizeof(Varying::Attribute) == Shader::V, "");
+    // Sets up and bins faces in parallel
+    renderer.pass.submit(scene.size, [&](const uint face, vec4& a, vec4& b, vec4& c, vec3 vertexAttributes[], typename Shader::FaceAttributes& faceAttributes) {
         const vec3 A (scene.X0[face], scene.Y0[face], scene.Z0[face]);
         const vec3 B (scene.X1[face], scene.Y1[face], scene.Z1[face]);
         const vec3 C (scene.X2[face], scene.Y2[face], scene.Z2[face]);
 
-        const vec4 a = M*vec4(A,1), b = M*vec4(B,1), c = M*vec4(C,1);
-        if(cross((b/b.w-a/a.w).xyz(),(c/c.w-a/a.w).xyz()).z >= 0) continue; // Backward face culling
+        a = M*vec4(A,1), b = M*vec4(B,1), c = M*vec4(C,1);
+        if(cross((b/b.w-a/a.w).xyz(),(c/c.w-a/a.w).xyz()).z >= 0) return false; // Backward face culling
 
-        renderer.pass.submit(a,b,c, (vec3[]){vec3(scene.U0[face],scene.U1[face],scene.U2[face]),
-                                             vec3(scene.V0[face],scene.V1[face],scene.V2[face]),
-                                             vec3(A.x,B.x,C.x),
-                                             vec3(A.y,B.y,C.y),
-                                             vec3(A.z,B.z,C.z),
-                                             vec3(scene.TX0[face],scene.TX1[face],scene.TX2[face]),
-                                             vec3(scene.TY0[face],scene.TY1[face],scene.TY2[face]),
-                                             vec3(scene.TZ0[face],scene.TZ1[face],scene.TZ2[face]),
-                                             vec3(scene.BX0[face],scene.BX1[face],scene.BX2[face]),
-                                             vec3(scene.BY0[face],scene.BY1[face],scene.BY2[face]),
-                                             vec3(scene.BZ0[face],scene.BZ1[face],scene.BZ2[face]),
-                                             vec3(scene.NX0[face],scene.NX1[face],scene.NX2[face]),
-                                             vec3(scene.NY0[face],scene.NY1[face],scene.NY2[face]),
-                                             vec3(scene.NZ0[face],scene.NZ1[face],scene.NZ2[face])}, face);
-    }
+        for(uint i: range(Shader::V)) vertexAttributes[i] = Varying::load(scene, face, Shader::attributes[i]); // Constant folds (unrolled)
+        faceAttributes = face;
+        return true;
+    });
     renderer.pass.render(renderer.target);
+}
+
+template<Type Shader, int S, Type... Args>
+void rasterize(Rasterizer<Shader, S>& renderer, const Scene& scene, mat4 M, float clear[/*sizeof...(Args)*/], const ImageH& depth, const Args&... targets_) {
+    const ImageH targets[sizeof...(Args)] { unsafeShare(targets_)... }; // Zero-length arrays are not permitted in C++
+    draw(renderer, scene, M, clear, (sizeof...(Args) ? targets[0] : depth).size);
     renderer.target.resolve(depth, targets);
 }
+
+/// Rasterizes directly to sRGB BGRA \a target (fused exposure scaling, sRGB encoding and untiling)
+template<Type Shader, int S>
+void rasterize(Rasterizer<Shader, S>& renderer, const Scene& scene, mat4 M, float clear[], const Image& target, float exposure = 1) {
+    draw(renderer, scene, M, clear, target.size);
+    renderer.target.resolve(target, exposure);
+}
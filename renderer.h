@@ -1,170 +1,644 @@
 #pragma once
 #include "radiosity.h"
+#include "thread.h"
 
 struct Render {
     Scene& scene;
-    Radiosity radiosity {scene};
+    Radiosity radiosity;
     static constexpr uint sSize = 4, tSize = sSize; // Number of view-dependent samples along (s,t) dimensions
-    Map map;
+    /// Sample file header (identifies solution to resume)
+    struct Header {
+        char magic[8];
+        uint version;
+        uint sSize, tSize, mode, groupCount;
+        uint64 scene, layout; // Hashes of geometry and materials, texel layout
+        uint64 sampleCount, diffuseCount, chartCount;
+        uint iterations; // Completed iterations (of committed slot)
+        uint committed; // Slot of last checkpoint (the other slot is being accumulated)
+    };
+    static constexpr char magic[8] = {'r','a','d','i','a','n','c','e'};
+    static constexpr uint version = 3;
+    static constexpr size_t headerSize = 4096; // Page aligns samples
+    uint checkpointInterval = 16; // Iterations between checkpoints (synchronous write back and commit of the sample file)
+    String name; // Sample file name prefix (detail cells, s, t, light groups) (suffixed by mode: solutions of each mode are kept)
+    uint64 layout = 0; // Hash of texel layout (identifies solutions)
+    Map map; // Header, 2 slots of: accumulation (single) (of each light group), squares, iterations
+    size_t slotSize = 0; // Bytes per slot (page aligned)
+    uint working = 0; // Slot being accumulated (the other slot holds the last checkpoint)
+    Header* header = 0;
+    Map published; // Front and back published buffers (file backed: written back and reclaimed by the kernel instead of pinned on the heap)
+    mref<float> samples[2]; // Published mean radiance (front, back)
+    bool interleaved = false; // Publishes (s,t) samples of each texel contiguously (see setSTSize)
+    mref<float> diffuse[2]; // Published mean (u,v) texture (average s,t) (front, back)
+    mref<float> diffuseBasis[2]; // Published mean (u,v) texture of each light group (unit gain) (front, back)
+    size_t groupStride = 0; // Accumulation floats per light group (3*sampleCount)
+    uint front = 0;
+    Lock publishLock; // Held while sampling front buffers (swapped by publish)
+    size_t batchSize = 0; // Work items per dispatch (0: whole step at once) (Yields thread pool to concurrent users between batches)
+    buffer<uint2> charts; // Triangles sharing a (u,v) texel block (second: scene.size if single)
+    buffer<uint> texelFace; // Triangle covering each (u,v) texel (scene.size: none)
+    struct Work { uint chart, start, size; }; // Range of rows of a chart
+    buffer<Work> work; // Shading work items (sorted by decreasing cost)
+    buffer<uint> chartWorkStart, chartWork; // Work items of each chart (chartWork[chartWorkStart[chart]:chartWorkStart[chart+1]])
+    // Relighting (concurrent with solver)
+    Lock stepLock; // Held by step while shading a batch (released between batches)
+    Condition stepResume; // Signaled when the last pause is released
+    uint pauses = 0; // Threads waiting to pause step between batches
+    size_t progress = 0; // Work items already shaded by the current step (accumulated one more sample)
+    // Adaptive sampling
+    float targetError = 1./256; // Chart error to stop refining (see chartError) (0: uniform)
+    uint minIterations = 4; // Minimum samples per texel before testing convergence
+    mref<float> squares; // Sum of squared luminance estimates of each (u,v) texel
+    mref<uint> iterations; // Samples per texel of each chart
+    buffer<float> chartError; // Standard error of texel mean luminance (RMS over covered texels) relative to chart mean luminance (black charts: absolute)
+    buffer<float> chartSum; // Sum of mean luminance of covered texels of each chart (unit gains)
+    float energy = 0; // Total mean luminance of last iteration (sum of chartSum)
+    float energyChange = inff; // Relative change of total mean luminance by last iteration (Indirect: bounces still propagating)
+    // Out-of-core paging (accumulation of each chart is paged as a tile)
+    size_t residentBudget; // Maximum resident accumulation bytes (0: whole map resident) (Bounds step batches to fit half the budget)
+    size_t residentSize = 0; // Accumulation bytes of resident tiles
+    uint64 pagingClock = 0; // Incremented by each paged batch
+    buffer<uint64> lastUse; // Paging clock of last batch using each chart (0: not resident)
+    buffer<bool> dirty; // Charts accumulated since last checkpoint (only charts differing between slots)
 
-    Render(Scene& scene) : scene(scene) {
+    /// \param groupCount Maximum number of light groups accumulated as separate bases (1: no relighting)
+    /// \param residentBudget Maximum resident accumulation bytes (0: unmanaged) (Solves sample maps larger than RAM)
+    Render(Scene& scene, Radiosity::Mode mode = Radiosity::AO, uint groupCount = 1, size_t residentBudget = 0)
+        : scene(scene), radiosity(scene, mode), residentBudget(residentBudget) {
+        assert_(groupCount >= 1 && groupCount <= Radiosity::maxGroupCount, groupCount);
+        groupLights(scene, groupCount);
         const Folder& folder = Folder(basename(arguments()[0]), "/var/tmp/"_, true);
         assert_(Folder(".",folder).name() == "/var/tmp/"+basename(arguments()[0]), folder.name());
-        for(string file: folder.list(Files)) remove(file, folder);
 
         const float detailCellCount = 32;
 
-        // Fits face UV to maximum projected sample rate
-        size_t sampleCount = 0;
-        for(size_t face : range(scene.size/2)) { // FIXME: Assumes quads (TODO: generic triangle UV mapping)
-            const vec3 p00 (scene.X0[2*face+0], scene.Y0[2*face+0], scene.Z0[2*face+0]);
-            const vec3 p01 (scene.X1[2*face+0], scene.Y1[2*face+0], scene.Z1[2*face+0]);
-            const vec3 p11 (scene.X2[2*face+0], scene.Y2[2*face+0], scene.Z2[2*face+0]);
-            const vec3 p10 (scene.X2[2*face+1], scene.Y2[2*face+1], scene.Z2[2*face+1]);
+        // Groups triangles in charts sharing a (u,v) texel block
+        array<uint2> charts;
+        {
+            auto vertex = [&scene](uint face, uint i) {
+                return i==0 ? vec3(scene.X0[face], scene.Y0[face], scene.Z0[face]) :
+                       i==1 ? vec3(scene.X1[face], scene.Y1[face], scene.Z1[face]) :
+                              vec3(scene.X2[face], scene.Y2[face], scene.Z2[face]);
+            };
+            auto setUV = [&scene](uint face, vec2 a, vec2 b, vec2 c) { // Normalized until chart is sized
+                scene.U0[face] = a.x, scene.U1[face] = b.x, scene.U2[face] = c.x;
+                scene.V0[face] = a.y, scene.V1[face] = b.y, scene.V2[face] = c.y;
+            };
+            array<uint> singles;
+            for(uint face=0; face<scene.size; face++) {
+                // Quad: coplanar triangles ABC, ACD
+                if(face+1 < scene.size && vertex(face+1, 0) == vertex(face, 0) && vertex(face+1, 1) == vertex(face, 2)
+                        && dot(vec3(scene.FNX[face], scene.FNY[face], scene.FNZ[face]), vec3(scene.FNX[face+1], scene.FNY[face+1], scene.FNZ[face+1])) > 1-0x1p-8) {
+                    setUV(face+0, vec2(0,0), vec2(1,0), vec2(1,1));
+                    setUV(face+1, vec2(0,0), vec2(1,1), vec2(0,1));
+                    charts.append(uint2(face, face+1));
+                    face++;
+                } else singles.append(face);
+            }
+            // Pairs remaining triangles of similar size in opposite halves of a block
+            auto area = [&vertex](uint face) { return length(cross(vertex(face, 1)-vertex(face, 0), vertex(face, 2)-vertex(face, 0))); };
+            sort<uint>([&area](const uint& a, const uint& b) { return area(a) < area(b); }, singles);
+            for(size_t i=0; i<singles.size; i+=2) {
+                setUV(singles[i], vec2(0,0), vec2(1,0), vec2(0,1));
+                if(i+1 < singles.size) setUV(singles[i+1], vec2(1,1), vec2(0,1), vec2(1,0));
+                charts.append(uint2(singles[i], i+1 < singles.size ? singles[i+1] : scene.size));
+            }
+        }
+        this->charts = copyRef(charts);
 
-            const vec3 faceCenter = (p00+p01+p11+p10)/4.f;
-            const vec3 N = normalize(cross(p11-p00, p01-p00));
-            // Viewpoint st with maximum projection area
-            vec2 st = clamp(vec2(-1), scene.scale*faceCenter.xy() + (scene.scale*faceCenter.z/(N.z==0?0/*-0 negates infinities*/:-N.z))*N.xy(), vec2(1));
-            if(!N.z) {
-                if(!N.x) st.x = 0;
-                if(!N.y) st.y = 0;
-            }
-            // Projects vertices along st view rays on uv plane (perspective)
-            mat4 M = shearedPerspective(st[0], st[1], scene.near, scene.far);
-            M.scale(scene.scale); // Fits scene within -1, 1
-            const vec2 uv00 = (M*p00).xy();
-            const vec2 uv01 = (M*p01).xy();
-            const vec2 uv11 = (M*p11).xy();
-            const vec2 uv10 = (M*p10).xy();
-            const float maxU = ::max(length(uv01-uv00), length(uv11-uv10)); // Maximum projected edge length along quad's u axis
-            const float maxV = ::max(length(uv10-uv00), length(uv11-uv01)); // Maximum projected edge length along quad's v axis
+        // Fits chart UV to maximum projected sample rate
+        size_t sampleCount = 0, diffuseCount = 0;
+        uint lastU = 0;
+        for(const uint2 chart : charts) {
+            float maxU = 0, maxV = 0; // Maximum projected length of chart (u,v) axes
+            for(const uint face: ref<uint>(chart)) {
+                if(face == scene.size) continue;
+                const vec3 p0 (scene.X0[face], scene.Y0[face], scene.Z0[face]);
+                const vec3 p1 (scene.X1[face], scene.Y1[face], scene.Z1[face]);
+                const vec3 p2 (scene.X2[face], scene.Y2[face], scene.Z2[face]);
+                const vec3 faceCenter = (p0+p1+p2)/3.f;
+                const vec3 N = normalize(cross(p2-p0, p1-p0));
+                // Viewpoint st with maximum projection area
+                vec2 st = clamp(vec2(-1), scene.scale*faceCenter.xy() + (scene.scale*faceCenter.z/(N.z==0?0/*-0 negates infinities*/:-N.z))*N.xy(), vec2(1));
+                if(!N.z) {
+                    if(!N.x) st.x = 0;
+                    if(!N.y) st.y = 0;
+                }
+                // Projects vertices along st view rays on uv plane (perspective)
+                mat4 M = shearedPerspective(st[0], st[1], scene.near, scene.far);
+                M.scale(scene.scale); // Fits scene within -1, 1
+                const vec2 q0 = (M*p0).xy(), q1 = (M*p1).xy(), q2 = (M*p2).xy();
+                // Derivatives of projection along chart (u,v) axes
+                const vec2 t0 (scene.U0[face], scene.V0[face]), t1 (scene.U1[face], scene.V1[face]), t2 (scene.U2[face], scene.V2[face]);
+                const vec2 e1 = q1-q0, e2 = q2-q0, d1 = t1-t0, d2 = t2-t0;
+                const float det = d1.x*d2.y - d2.x*d1.y;
+                maxU = ::max(maxU, length((e1*d2.y - e2*d1.y)/det));
+                maxV = ::max(maxV, length((e2*d1.x - e1*d2.x)/det));
+            }
 
             const float cellCount = detailCellCount; //face.reflect ? detailCellCount : 1;
-            const uint U = align(2, ceil(maxU*cellCount)), V = align(2, ceil(maxV*cellCount)); // Aligns UV to 2 for correct 32bit gather indexing
-            assert_(U && V, p00, p01, p11, p10);
+            const uint U = ::max(size_t(2), align(2, ceil(maxU*cellCount))), V = ::max(size_t(2), align(2, ceil(maxV*cellCount))); // Aligns UV to 2 for correct 32bit gather indexing
 
             // Allocates (s,t) (u,v) images
-            scene.BGR[face*2+0] = scene.BGR[face*2+1] = 3*sampleCount;
-            scene.size1[face*2+0] = scene.size1[face*2+1] = U;
-            scene.V[face*2+0] = scene.V[face*2+1] = V;
-            scene.size2[face*2+0] = scene.size2[face*2+1] = V*U;
+            for(const uint face: ref<uint>(chart)) {
+                if(face == scene.size) continue;
+                scene.BGR[face] = 3*sampleCount;
+                scene.size1[face] = U;
+                scene.V[face] = V;
+                scene.size2[face] = V*U;
+                scene.diffuseBGR[face] = 3*diffuseCount;
+                // Scales uv for texture sampling (unnormalized)
+                scene.U0[face] *= U-1; scene.U1[face] *= U-1; scene.U2[face] *= U-1;
+                scene.V0[face] *= V-1; scene.V1[face] *= V-1; scene.V2[face] *= V-1;
+            }
             sampleCount += tSize*sSize*V*U;
-            if(2*face+1 == scene.size-1) sampleCount += U; // Prevents OOB on interpolation
+            diffuseCount += V*U;
+            lastU = U;
+        }
+        sampleCount += lastU; // Prevents OOB on interpolation
+        diffuseCount += lastU; // Prevents OOB on interpolation
 
-            // Scales uv for texture sampling (unnormalized)
-            scene.U0[2*face+0] = scene.U0[2*face+0] ? U-1 : 0;
-            scene.U1[2*face+0] = scene.U1[2*face+0] ? U-1 : 0;
-            scene.U2[2*face+0] = scene.U2[2*face+0] ? U-1 : 0;
-            scene.V0[2*face+0] = scene.V0[2*face+0] ? V-1 : 0;
-            scene.V1[2*face+0] = scene.V1[2*face+0] ? V-1 : 0;
-            scene.V2[2*face+0] = scene.V2[2*face+0] ? V-1 : 0;
-            scene.U0[2*face+1] = scene.U0[2*face+1] ? U-1 : 0;
-            scene.U1[2*face+1] = scene.U1[2*face+1] ? U-1 : 0;
-            scene.U2[2*face+1] = scene.U2[2*face+1] ? U-1 : 0;
-            scene.V0[2*face+1] = scene.V0[2*face+1] ? V-1 : 0;
-            scene.V1[2*face+1] = scene.V1[2*face+1] ? V-1 : 0;
-            scene.V2[2*face+1] = scene.V2[2*face+1] ? V-1 : 0;
+        // Assigns texels to the chart triangle covering their center
+        texelFace = buffer<uint>(diffuseCount);
+        texelFace.clear(scene.size);
+        for(const uint2 chart: charts) {
+            const uint U = scene.size1[chart[0]], V = scene.V[chart[0]];
+            for(uint svIndex: range(V)) for(uint suIndex: range(U)) {
+                float best = -0x1p-8; // Tolerance
+                uint& texel = texelFace[scene.diffuseBGR[chart[0]]/3 + svIndex*U + suIndex];
+                for(const uint face: ref<uint>(chart)) {
+                    if(face == scene.size) continue;
+                    const vec3 b = barycentric(face, suIndex, svIndex);
+                    const float min = ::min(::min(b[0], b[1]), b[2]);
+                    if(min > best) { best = min; texel = face; }
+                }
+            }
         }
 
         assert_(uint(detailCellCount) == detailCellCount);
-        File file(str(uint(detailCellCount))+'x'+str(sSize)+'x'+str(tSize), folder, Flags(ReadWrite|Create));
-        size_t byteSize = 3*sampleCount*sizeof(Float);
-        assert_(byteSize <= 28800ull*1024*1024, byteSize/(1024*1024*1024.f));
-        file.resize(byteSize);
+        name = str(uint(detailCellCount))+'x'+str(sSize)+'x'+str(tSize)+'x'+str(scene.groupCount);
+        const size_t chartCount = charts.size;
+        groupStride = 3*sampleCount;
+        layout = ::hash(raw(uint(detailCellCount)));
+        const buffer<uint>* arrays[] = {&scene.BGR, &scene.diffuseBGR, &scene.size1, &scene.V, &texelFace, &scene.group};
+        for(const buffer<uint>* data: arrays) layout = ::hash(cast<byte>(ref<uint>(*data)), layout);
+        { // Splits charts in row ranges of similar cost (texel count) to balance load
+            const size_t grain = ::max(diffuseCount/(32*threadCount()), size_t(64));
+            array<Work> work;
+            for(size_t chart : range(chartCount)) {
+                const uint U = scene.size1[charts[chart][0]], V = scene.V[charts[chart][0]];
+                const uint rows = ::max(uint(1), uint(grain/U));
+                for(uint start=0; start<V; start+=rows) work.append(Work{uint(chart), start, ::min(rows, V-start)});
+            }
+            // Largest first (sort partitions greater elements first)
+            sort<Work>([this](const Work& a, const Work& b) { return a.size*scene.size1[charts[a.chart][0]] < b.size*scene.size1[charts[b.chart][0]]; }, work);
+            this->work = copyRef(work);
+            chartWorkStart = buffer<uint>(chartCount+1); chartWorkStart.clear(0);
+            for(const Work& item: work) chartWorkStart[item.chart+1]++;
+            for(size_t chart: range(chartCount)) chartWorkStart[chart+1] += chartWorkStart[chart];
+            chartWork = buffer<uint>(work.size);
+            buffer<uint> next = copyRef(chartWorkStart.slice(0, chartCount));
+            for(size_t workIndex: range(work.size)) chartWork[next[work[workIndex].chart]++] = workIndex;
+        }
+        { // Maps published front and back buffers (page aligned)
+            const size_t sampleSize = 3*sampleCount + 3*(lastU+2)*tSize*sSize; // Prevents OOB on interleaved interpolation (next row of last texel)
+            const size_t samplesByteSize = align(4096, sampleSize*sizeof(float));
+            const size_t diffuseByteSize = align(4096, 3*diffuseCount*sizeof(float));
+            const size_t basisByteSize = align(4096, scene.groupCount*3*diffuseCount*sizeof(float));
+            const size_t bufferSize = samplesByteSize+diffuseByteSize+basisByteSize;
+            File file(name+'.'+Radiosity::modes[radiosity.mode]+".published", folder, Flags(ReadWrite|Create)); // Per configuration (concurrent processes may solve other modes) (republished by setMode)
+            if(file.size() != 2*bufferSize) { file.resize(0); file.resize(2*bufferSize); } // Zero fills (padding is never written)
+            published = Map(file, Map::Prot(Map::Read|Map::Write));
+            for(uint i: range(2)) {
+                samples[i] = mcast<float>(published.slice(i*bufferSize, sampleSize*sizeof(float)));
+                diffuse[i] = mcast<float>(published.slice(i*bufferSize+samplesByteSize, 3*diffuseCount*sizeof(float)));
+                diffuseBasis[i] = mcast<float>(published.slice(i*bufferSize+samplesByteSize+diffuseByteSize, scene.groupCount*3*diffuseCount*sizeof(float)));
+            }
+        }
+        chartError = buffer<float>(chartCount);
+        chartSum = buffer<float>(chartCount);
+        lastUse = buffer<uint64>(chartCount); lastUse.clear(0);
+        dirty = buffer<bool>(chartCount); dirty.clear(false);
+        scene.samples = samples[front];
+        scene.diffuse = diffuse[front];
+        scene.diffuseBasis = diffuseBasis[front];
+        setSTSize(scene, sSize, tSize, interleaved);
+        open();
+    }
+    /// Maps the sample file of the current mode, resumes its last checkpoint or restarts its solution
+    /// \note Each mode and light group count is solved in its own file (switching configuration never overwrites another solution)
+    void open() {
+        const Folder folder (basename(arguments()[0]), "/var/tmp/"_, true);
+        File file(name+'.'+Radiosity::modes[radiosity.mode], folder, Flags(ReadWrite|Create));
+        const size_t diffuseCount = texelFace.size, chartCount = charts.size;
+        slotSize = align(4096, (scene.groupCount*groupStride+diffuseCount)*sizeof(float) + chartCount*sizeof(uint));
+        size_t byteSize = headerSize + 2*slotSize; // Double buffered (crash consistent checkpoints)
+        assert_(residentBudget || slotSize <= 28800ull*1024*1024, slotSize/(1024*1024*1024.f)); // Only the working slot is accessed between checkpoints
+        if(file.size() != byteSize) file.resize(byteSize);
         map = Map(file, Map::Prot(Map::Read|Map::Write));
-        scene.samples= mcast<Float>(map);
-        setSTSize(scene, sSize, tSize);
+        header = (Header*)map.data;
+        if(residentBudget) { lastUse.clear(0); residentSize = 0; } // Tiles of previous map
+        const Header expected {{}, version, sSize, tSize, uint(radiosity.mode), scene.groupCount, ::hash(scene), layout, groupStride/3, diffuseCount, chartCount, 0, 0};
+        if(ref<char>(header->magic, 8) == ref<char>(magic, 8) && header->version == expected.version
+                && header->sSize == expected.sSize && header->tSize == expected.tSize && header->mode == expected.mode && header->groupCount == expected.groupCount
+                && header->scene == expected.scene && header->layout == expected.layout && header->sampleCount == expected.sampleCount
+                && header->diffuseCount == expected.diffuseCount && header->chartCount == expected.chartCount
+                && header->iterations && header->committed < 2) { // Resumes from last checkpoint
+            setSlot(header->committed);
+            scene.iterations = header->iterations;
+            energy = 0, energyChange = inff;
+            log("Resumes", scene.iterations, Radiosity::modes[radiosity.mode], "iterations");
+            branch();
+            publish();
+        } else {
+            *header = expected;
+            mref<char>(header->magic, 8).copy(ref<char>(magic, 8));
+            setSlot(0);
+            reset();
+        }
+    }
+    /// Checkpoints the solution of the current mode and continues with the solution of \a mode (resumed or restarted)
+    void setMode(Radiosity::Mode mode) {
+        Pause pause (*this);
+        checkpoint();
+        radiosity.mode = mode;
+        open();
+    }
+    /// Barycentric coordinates of texel (\a suIndex, \a svIndex) center in \a face
+    vec3 barycentric(uint face, uint suIndex, uint svIndex) const {
+        const uint U = scene.size1[face], V = scene.V[face];
+        // Texel centers are shaded at ((i+1/2)/U, (j+1/2)/V) of the chart (unnormalized like face UV)
+        const vec2 p ((suIndex+1.f/2)/U*(U-1), (svIndex+1.f/2)/V*(V-1));
+        const vec2 t0 (scene.U0[face], scene.V0[face]), d1 = vec2(scene.U1[face], scene.V1[face])-t0, d2 = vec2(scene.U2[face], scene.V2[face])-t0, d = p-t0;
+        const float det = d1.x*d2.y - d2.x*d1.y;
+        const float b1 = (d.x*d2.y - d2.x*d.y)/det, b2 = (d1.x*d.y - d.x*d1.y)/det;
+        return vec3(1-b1-b2, b1, b2);
     }
+    /// Points accumulation, squares and iterations to \a slot of the sample file
+    void setSlot(uint slot) {
+        working = slot;
+        const size_t base = headerSize + slot*slotSize, diffuseCount = texelFace.size;
+        scene.accumulation = mcast<float>(map.slice(base, scene.groupCount*groupStride*sizeof(float)));
+        squares = mcast<float>(map.slice(base+scene.groupCount*groupStride*sizeof(float), diffuseCount*sizeof(float)));
+        iterations = mcast<uint>(map.slice(base+(scene.groupCount*groupStride+diffuseCount)*sizeof(float), charts.size*sizeof(uint)));
+    }
+    /// Continues accumulation in the other slot from a copy of the whole working slot (other slot is stale: resume)
+    void branch() {
+        const size_t source = headerSize + working*slotSize, target = headerSize + (working^1)*slotSize;
+        const size_t chunk = residentBudget ? align(4096, ::max(residentBudget/4, size_t(1)<<20)) : slotSize; // Paged: copies and evicts chunks fitting the budget
+        for(size_t offset = 0; offset < slotSize; offset += chunk) {
+            const size_t size = ::min(chunk, slotSize-offset);
+            parallel_chunk(size/4096, [&](uint, size_t start, size_t count) { // Page granularity
+                map.slice(target+offset+start*4096, count*4096).copy(map.slice(source+offset+start*4096, count*4096));
+            });
+            if(residentBudget) { map.evict(source+offset, size); map.evict(target+offset, size); }
+        }
+        if(residentBudget) { lastUse.clear(0); residentSize = 0; } // All tiles evicted
+        dirty.clear(false);
+        setSlot(working^1);
+    }
+    /// Writes back the working slot, commits it as the resumable solution and continues in the other slot
+    /// \note The committed slot is not written until the next commit is durable (a crash resumes the last checkpoint consistently)
+    /// \note The other slot holds the previous checkpoint: only charts accumulated since then are copied
+    void checkpoint() {
+        map.sync(); // Working slot (before commit) (writes back dirty pages only)
+        header->mode = radiosity.mode;
+        header->iterations = scene.iterations;
+        header->committed = working;
+        map.sync(); // Header (before overwriting the previous checkpoint)
+        const uint source = working, target = working^1;
+        array<uint> dirtyCharts;
+        for(size_t chart: range(charts.size)) if(dirty[chart]) dirtyCharts.append(chart);
+        const size_t diffuseCount = texelFace.size;
+        parallel_for(0, dirtyCharts.size, [&](uint, uint index) {
+            const uint chart = dirtyCharts[index], face = charts[chart][0];
+            auto copy = [&](size_t offset, size_t size) {
+                map.slice(headerSize+target*slotSize+offset, size).copy(map.slice(headerSize+source*slotSize+offset, size));
+            };
+            for(uint g: range(scene.groupCount)) {
+                copy((g*groupStride + scene.BGR[face])*sizeof(float), tileSize(chart));
+                if(residentBudget) { map.evict(tileOffset(g, chart, source), tileSize(chart)); map.evict(tileOffset(g, chart, target), tileSize(chart)); }
+            }
+            copy((scene.groupCount*groupStride + scene.diffuseBGR[face]/3)*sizeof(float), scene.size2[face]*sizeof(float)); // Squares
+            copy((scene.groupCount*groupStride + diffuseCount)*sizeof(float) + chart*sizeof(uint), sizeof(uint)); // Iterations
+        });
+        if(residentBudget) { // Tiles of clean charts are resident in the committed slot (clean after sync)
+            for(size_t chart: range(charts.size)) if(lastUse[chart] && !dirty[chart]) for(uint g: range(scene.groupCount)) map.evict(tileOffset(g, chart, source), tileSize(chart));
+            lastUse.clear(0); residentSize = 0;
+        }
+        dirty.clear(false);
+        setSlot(target);
+    }
+    /// Accumulation byte offset of \a chart tile of light group \a g in map (of \a slot)
+    size_t tileOffset(uint g, size_t chart, uint slot) const { return headerSize + slot*slotSize + (g*groupStride + scene.BGR[charts[chart][0]])*sizeof(float); }
+    /// Accumulation byte offset of \a chart tile of light group \a g in map (working slot)
+    size_t tileOffset(uint g, size_t chart) const { return tileOffset(g, chart, working); }
+    /// Accumulation byte size of \a chart tile (of each light group)
+    size_t tileSize(size_t chart) const { return 3*tSize*sSize*scene.size2[charts[chart][0]]*sizeof(float); }
+    /// Prefetches tiles of \a charts and evicts least recently used tiles until resident size fits budget
+    /// \note Squares and iterations (1/(3·s·t) of a basis) stay resident
+    void page(ref<uint> charts) {
+        if(!residentBudget) return;
+        pagingClock++;
+        for(const uint chart: charts) {
+            if(!lastUse[chart]) { // Faults in asynchronously
+                for(uint g: range(scene.groupCount)) map.prefetch(tileOffset(g, chart), tileSize(chart));
+                residentSize += scene.groupCount*tileSize(chart);
+            }
+            lastUse[chart] = pagingClock;
+        }
+        if(residentSize <= residentBudget) return;
+        array<uint> resident; // Evictable (not used by this batch)
+        for(size_t chart: range(lastUse.size)) if(lastUse[chart] && lastUse[chart] < pagingClock) resident.append(chart);
+        // Least recently used first (sort partitions greater elements first)
+        sort<uint>([this](const uint a, const uint b) { return lastUse[a] > lastUse[b]; }, resident);
+        for(const uint chart: resident) {
+            if(residentSize <= residentBudget) break;
+            for(uint g: range(scene.groupCount)) map.evict(tileOffset(g, chart), tileSize(chart));
+            residentSize -= scene.groupCount*tileSize(chart);
+            lastUse[chart] = 0;
+        }
+    }
+    /// Whether \a chart reached the target error
+    /// \note Indirect: no chart converges while bounces still change the total radiance (distant surfaces are lit after several iterations)
+    bool converged(size_t chart) const {
+        return targetError && iterations[chart] >= minIterations && chartError[chart] < targetError
+                && (radiosity.mode != Radiosity::Indirect || energyChange < targetError);
+    }
+    /// Holds step at a batch boundary (with priority over step which otherwise reacquires stepLock as soon as it releases it)
+    struct Pause {
+        Render& render;
+        Pause(Render& render) : render(render) { __sync_add_and_fetch(&render.pauses, 1); render.stepLock.lock(); }
+        ~Pause() { __sync_sub_and_fetch(&render.pauses, 1); pthread_cond_broadcast(&render.stepResume); render.stepLock.unlock(); }
+    };
+    /// Calls \a f(chart) for all charts in parallel (in batches of charts whose tiles fit half the resident budget)
+    template<Type F> void forCharts(F f) {
+        for(size_t start = 0; start < charts.size;) {
+            size_t stop = charts.size;
+            if(residentBudget) { // Batches charts fitting half the budget
+                array<uint> batch;
+                size_t size = 0;
+                for(stop = start; stop < charts.size && (stop == start || size + scene.groupCount*tileSize(stop) <= residentBudget/2); stop++) {
+                    size += scene.groupCount*tileSize(stop);
+                    batch.append(stop);
+                }
+                page(batch);
+            }
+            parallel_for(start, stop, [&f](uint, uint chart) { f(chart); });
+            start = stop;
+        }
+    }
+    /// Recombines light group bases of \a chart with scene gains into \a back samples (from accumulation) and diffuse texture (from \a back diffuse bases)
+    /// \note Rows of work items before \a progress accumulated one more sample (step paused between batches)
+    void recombine(const size_t chart, const uint back) {
+        const uint face = charts[chart][0];
+        const uint U = scene.size1[face];
+        const size_t size2 = scene.size2[face], size4 = tSize*sSize*size2;
+        const uint groupCount = scene.groupCount;
+        { // Samples (accumulation is planar: [c][t][s][v][u])
+            float* const target = samples[back].begin() + scene.BGR[face];
+            for(const uint workIndex: chartWork.slice(chartWorkStart[chart], chartWorkStart[chart+1]-chartWorkStart[chart])) {
+                const float n = iterations[chart] + (workIndex < progress && !converged(chart));
+                const size_t begin = work[workIndex].start*U, end = (work[workIndex].start+work[workIndex].size)*U;
+                for(size_t c: range(3)) {
+                    v8sf gains[Radiosity::maxGroupCount];
+                    for(uint g: range(groupCount)) gains[g] = float8(scene.gain[g][c]/n);
+                    for(size_t st: range(tSize*sSize)) {
+                        const float* const source = scene.accumulation.data + scene.BGR[face] + c*size4 + st*size2;
+                        // Interleaved: [v][u][t][s][c]
+                        float* const texels = interleaved ? target + st*3 + c : target + c*size4 + st*size2;
+                        const size_t stride = interleaved ? 3*tSize*sSize : 1;
+                        size_t i = begin;
+                        for(; i+8 <= end; i+=8) {
+                            v8sf sum = 0;
+                            for(uint g: range(groupCount)) { v8sf x; __builtin_memcpy(&x, source+g*groupStride+i, sizeof(x)); sum += gains[g] * x; } // Unaligned
+                            if(interleaved) { for(uint k: range(8)) texels[(i+k)*stride] = sum[k]; }
+                            else __builtin_memcpy(texels+i, &sum, sizeof(sum));
+                        }
+                        for(; i < end; i++) {
+                            float sum = 0;
+                            for(uint g: range(groupCount)) sum += gains[g][0] * source[g*groupStride + i];
+                            texels[i*stride] = sum;
+                        }
+                    }
+                }
+            }
+        }
+        { // Diffuse texture (bases are means with unit gains)
+            const size_t diffuseStride = diffuseBasis[back].size/groupCount;
+            for(size_t c: range(3)) {
+                float* const target = diffuse[back].begin() + scene.diffuseBGR[face] + c*size2;
+                const float* const source = diffuseBasis[back].data + scene.diffuseBGR[face] + c*size2;
+                v8sf gains[Radiosity::maxGroupCount];
+                for(uint g: range(groupCount)) gains[g] = float8(scene.gain[g][c]);
+                size_t i = 0;
+                for(; i+8 <= size2; i+=8) {
+                    v8sf sum = 0;
+                    for(uint g: range(groupCount)) { v8sf x; __builtin_memcpy(&x, source+g*diffuseStride+i, sizeof(x)); sum += gains[g] * x; } // Unaligned
+                    __builtin_memcpy(target+i, &sum, sizeof(sum));
+                }
+                for(; i < size2; i++) {
+                    float sum = 0;
+                    for(uint g: range(groupCount)) sum += gains[g][0] * source[g*diffuseStride + i];
+                    target[i] = sum;
+                }
+            }
+        }
+    }
+    /// Swaps front and back buffers
+    void swap() {
+        Locker lock(publishLock);
+        front = front^1;
+        scene.samples = samples[front];
+        scene.diffuse = diffuse[front];
+        scene.diffuseBasis = diffuseBasis[front];
+    }
+    /// Writes mean of accumulated samples (and diffuse texture) to back buffers and swaps front and back
+    /// Recombines light group bases with scene gains and updates error estimates
+    void publish() {
+        const uint back = front^1;
+        forCharts([this, back](uint chart) {
+            const uint face = charts[chart][0];
+            const size_t size2 = scene.size2[face], size4 = tSize*sSize*size2;
+            const float n = iterations[chart];
+            const uint groupCount = scene.groupCount;
+            const size_t diffuseStride = diffuseBasis[back].size/groupCount;
+            { // Diffuse bases: mean of (s,t) samples of each light group
+                const float scale = 1.f/(tSize*sSize*n);
+                for(uint g: range(groupCount)) for(size_t c: range(3)) {
+                    const float* const source = scene.accumulation.data + g*groupStride + scene.BGR[face] + c*size4;
+                    float* const basis = diffuseBasis[back].begin() + g*diffuseStride + scene.diffuseBGR[face] + c*size2;
+                    for(size_t i: range(size2)) {
+                        float sum = 0;
+                        for(size_t st: range(tSize*sSize)) sum += source[st*size2 + i];
+                        basis[i] = scale * sum;
+                    }
+                }
+            }
+            recombine(chart, back);
+            // Standard error of texel mean luminance (per sample variance / n, RMS over covered texels)
+            const float* const squares = this->squares.data + scene.diffuseBGR[face]/3;
+            const uint* const texelFace = this->texelFace.data + scene.diffuseBGR[face]/3;
+            float sumMean = 0, sumVariance = 0; uint count = 0;
+            for(size_t i: range(size2)) {
+                if(texelFace[i] == scene.size) continue;
+                float mean = 0; // Unit gains (as squares)
+                for(uint g: range(groupCount)) {
+                    const float* const basis = diffuseBasis[back].data + g*diffuseStride + scene.diffuseBGR[face];
+                    mean += (basis[0*size2+i] + basis[1*size2+i] + basis[2*size2+i])/3;
+                }
+                sumMean += mean;
+                sumVariance += ::max(0.f, squares[i]/n - mean*mean);
+                count++;
+            }
+            const float error = count ? sqrt(sumVariance/(n*count)) : 0;
+            chartError[chart] = sumMean ? error / (sumMean/count) : error; // Black charts: absolute (every sample black: converges after minIterations)
+            chartSum[chart] = sumMean;
+        });
+        swap();
+#if BVH
+        radiosity.update(); // Aggregates published radiance of face clusters
+#endif
+    }
+    /// Selects layout of published samples and republishes
+    void setLayout(bool interleaved) {
+        Pause pause (*this);
+        {Locker lock(publishLock);
+            this->interleaved = interleaved;
+            setSTSize(scene, sSize, tSize, interleaved);
+        }
+        publish();
+    }
+    /// Sets intensity and color of each light group and recombines published bases (without solving)
+    /// \note Waits at most for the current batch of the solver (recombines partially accumulated step with per row sample counts)
+    /// \note Diffuse bases and cluster radiance (unit gains) are unchanged
+    void relight(ref<bgr3f> gain) {
+        assert_(gain.size == scene.groupCount, gain.size, scene.groupCount);
+        Pause pause (*this);
+        mref<bgr3f>(scene.gain).copy(gain); // In place (concurrent shading reads gains)
+        const uint back = front^1;
+        diffuseBasis[back].copy(diffuseBasis[front]);
+        forCharts([this, back](uint chart) { recombine(chart, back); });
+        swap();
+    }
+    /// Restarts solution of the current mode
     void clear() {
-        for(size_t face : range(scene.size/2)) { // FIXME: Assumes quads (TODO: generic triangle UV mapping)
-            const size_t size4 = tSize*sSize*scene.size2[face*2+0];
-            const mref<Float> faceBGR = scene.samples.slice(scene.BGR[face], size4);
-            faceBGR.slice(0*size4, size4).clear(scene.emittanceB[face]);
-            faceBGR.slice(1*size4, size4).clear(scene.emittanceG[face]);
-            faceBGR.slice(2*size4, size4).clear(scene.emittanceR[face]);
+        Pause pause (*this);
+        reset();
+    }
+    /// Initializes accumulation to emittance and publishes (caller excludes step and relight)
+    void reset() {
+        for(size_t chart : range(charts.size)) {
+            const uint index = chart;
+            page(ref<uint>(&index, 1));
+            const uint U = scene.size1[charts[chart][0]], V = scene.V[charts[chart][0]], size2 = V*U;
+            const size_t size4 = tSize*sSize*size2;
+            float* const faceBGR = scene.accumulation.begin() + scene.BGR[charts[chart][0]];
+            const size_t diffuseBase = scene.diffuseBGR[charts[chart][0]]/3;
+            for(size_t i: range(size2)) { // Emittance of covering face (in its light group basis)
+                const uint face = texelFace[diffuseBase+i];
+                const bgr3f E = face == scene.size ? bgr3f(0.f) : bgr3f(scene.emittanceB[face], scene.emittanceG[face], scene.emittanceR[face]);
+                for(uint g: range(scene.groupCount)) {
+                    const bgr3f groupE = face != scene.size && scene.group[face] == g ? E : bgr3f(0.f);
+                    for(size_t st: range(tSize*sSize)) {
+                        faceBGR[g*groupStride + 0*size4 + st*size2 + i] = groupE.b;
+                        faceBGR[g*groupStride + 1*size4 + st*size2 + i] = groupE.g;
+                        faceBGR[g*groupStride + 2*size4 + st*size2 + i] = groupE.r;
+                    }
+                }
+                squares[diffuseBase+i] = sq((E.b+E.g+E.r)/3);
+            }
+            iterations[chart] = 1;
+            dirty[chart] = true;
         }
         scene.iterations=1;
+        energy = 0, energyChange = inff;
+        checkpoint();
+        publish();
     }
     void step() {
         Random randoms[threadCount()];
         for(Random& random: mref<Random>(randoms,threadCount())) { random=Random(); }
         {Random random; radiosity.lookup.generate(random);} // New set of stratified cosine samples for hemispheric rasterizer
-        // FIXME: TODO: store diffuse (average s,t) texture for non-primary (diffuse) evaluation
-        setST(scene, 1./2, 1./2);
-        for(size_t face : range(scene.size/2)) { // FIXME: Assumes quads (TODO: generic triangle UV mapping)
-            const vec3 p00 (scene.X0[2*face+0], scene.Y0[2*face+0], scene.Z0[2*face+0]);
-            const vec3 p01 (scene.X1[2*face+0], scene.Y1[2*face+0], scene.Z1[2*face+0]);
-            const vec3 p11 (scene.X2[2*face+0], scene.Y2[2*face+0], scene.Z2[2*face+0]);
-            const vec3 p10 (scene.X2[2*face+1], scene.Y2[2*face+1], scene.Z2[2*face+1]);
-            const vec3 t00 = (scene.TX0[2*face+0], scene.TY0[2*face+0], scene.TZ0[2*face+0]);
-            const vec3 t01 = (scene.TX1[2*face+0], scene.TY1[2*face+0], scene.TZ1[2*face+0]);
-            const vec3 t11 = (scene.TX2[2*face+0], scene.TY2[2*face+0], scene.TZ2[2*face+0]);
-            const vec3 t10 = (scene.TX2[2*face+1], scene.TY2[2*face+1], scene.TZ0[2*face+1]);
-            const vec3 b00 = (scene.BX0[2*face+0], scene.BY0[2*face+0], scene.BZ0[2*face+0]);
-            const vec3 b01 = (scene.BX1[2*face+0], scene.BY1[2*face+0], scene.BZ1[2*face+0]);
-            const vec3 b11 = (scene.BX2[2*face+0], scene.BY2[2*face+0], scene.BZ2[2*face+0]);
-            const vec3 b10 = (scene.BX2[2*face+1], scene.BY2[2*face+1], scene.BZ0[2*face+1]);
-            const vec3 n00 = (scene.NX0[2*face+0], scene.NY0[2*face+0], scene.NZ0[2*face+0]);
-            const vec3 n01 = (scene.NX1[2*face+0], scene.NY1[2*face+0], scene.NZ1[2*face+0]);
-            const vec3 n11 = (scene.NX2[2*face+0], scene.NY2[2*face+0], scene.NZ2[2*face+0]);
-            const vec3 n10 = (scene.NX2[2*face+1], scene.NY2[2*face+1], scene.NZ0[2*face+1]);
-
-            const uint U = scene.size1[face*2+0], V = scene.V[face*2+0], size2 = V*U;
-            const size_t size4 = tSize*sSize*V*U;
-            const mref<Float> faceBGR = scene.samples.slice(scene.BGR[face], size4);
-
-            const vec3 ab = p01-p00;
-            const vec3 ad = p10-p00;
-            const vec3 badc = p00-p01+p11-p10;
-
-            const vec3 Tab = t01-t00;
-            const vec3 Tad = t10-t00;
-            const vec3 Tbadc = t00-t01+t11-t10;
-
-            const vec3 Bab = b01-b00;
-            const vec3 Bad = b10-b00;
-            const vec3 Bbadc = b00-b01+b11-b10;
-
-            const vec3 Nab = n01-n00;
-            const vec3 Nad = n10-n00;
-            const vec3 Nbadc = n00-n01+n11-n10;
+        // Shades surfaces
+        size_t batchSize = this->batchSize ? this->batchSize : work.size;
+        if(residentBudget && charts) { // Bounds batches to tiles fitting half the budget (each work item shades a single chart)
+            size_t maxTileSize = 0;
+            for(size_t chart: range(charts.size)) maxTileSize = ::max(maxTileSize, scene.groupCount*tileSize(chart));
+            batchSize = ::min(batchSize, ::max(size_t(1), residentBudget/2/maxTileSize));
+        }
+        for(size_t batch=0; batch<work.size; batch+=batchSize) {
+            Locker lock(stepLock);
+            while(pauses) pthread_cond_wait(&stepResume, &stepLock); // Yields to relight
+            if(residentBudget) { // Prefetches tiles of batch (evicts least recently used)
+                array<uint> batchCharts;
+                for(const Work& item: work.slice(batch, ::min(batchSize, work.size-batch)))
+                    if(!converged(item.chart)) batchCharts.append(item.chart);
+                page(batchCharts); // (Ignores repeated charts)
+            }
+            parallel_for(batch, ::min(batch+batchSize, work.size), [&](const uint id, const uint workIndex) {
+                const size_t chart = work[workIndex].chart;
+                if(converged(chart)) return;
+                const uint U = scene.size1[charts[chart][0]], V = scene.V[charts[chart][0]], size2 = V*U;
+                const size_t size4 = tSize*sSize*V*U;
+                float* const faceBGR = scene.accumulation.begin() + scene.BGR[charts[chart][0]];
+                const size_t diffuseBase = scene.diffuseBGR[charts[chart][0]]/3;
 
-            // Shades surface
-            parallel_for(0, V, [&](const uint id, const uint svIndex) {
-                tsc totalTSC;
-                totalTSC.start();
-                for(uint suIndex: range(U)) {
-                    const float v = (float(svIndex)+1.f/2)/float(V);
-                    const float u = (float(suIndex)+1.f/2)/float(U);
-                    const vec3 P = p00 + ad*v + (ab + badc*v) * u;
-                    const vec3 T = t00 + Tad*v + (Tab + Tbadc*v) * u;
-                    const vec3 B = b00 + Bad*v + (Bab + Bbadc*v) * u;
-                    const vec3 N = n00 + Nad*v + (Nab + Nbadc*v) * u;
-                    const size_t base0 = svIndex*U+suIndex;
-                    /*if(scene.faces[faceIndex*2].reflect) {
-                        for(uint t: range(tSize)) for(uint s: range(sSize)) {
-                            const vec3 viewpoint = vec3((s/float(sSize-1))*2-1, (t/float(tSize-1))*2-1, 0)/scene.scale;
-                            const vec3 D = normalize(P-viewpoint);
-                            bgr3f color = scene.shade(faceIndex*2+0, P, D, T, B, N, randoms[id]);
-                            const size_t base = base0 + (sSize * t + s) * VU;
-                            faceBGR[0*size4+base] += color.b;
-                            faceBGR[1*size4+base] += color.g;
-                            faceBGR[2*size4+base] += color.r;
-                        }
-                    } else*/ {
-                        const vec3 D = normalize(P);
-                        bgr3f color = radiosity.shade(face*2+0, P, D, T, B, N, randoms[id]);
-                        for(uint t: range(tSize)) for(uint s: range(sSize)) {
-                            const size_t base = base0 + (sSize * t + s) * size2;
-                            faceBGR[0*size4+base] += color.b;
-                            faceBGR[1*size4+base] += color.g;
-                            faceBGR[2*size4+base] += color.r;
+                for(uint svIndex: range(work[workIndex].start, work[workIndex].start+work[workIndex].size)) {
+                    for(uint suIndex: range(U)) {
+                        const size_t base0 = svIndex*U+suIndex;
+                        const uint face = texelFace[diffuseBase+base0];
+                        if(face == scene.size) continue; // Uncovered
+                        // Interpolates vertex attributes
+                        const vec3 b = barycentric(face, suIndex, svIndex);
+                        const vec3 P = b[0]*vec3(scene.X0[face], scene.Y0[face], scene.Z0[face]) + b[1]*vec3(scene.X1[face], scene.Y1[face], scene.Z1[face]) + b[2]*vec3(scene.X2[face], scene.Y2[face], scene.Z2[face]);
+                        const vec3 T = b[0]*vec3(scene.TX0[face], scene.TY0[face], scene.TZ0[face]) + b[1]*vec3(scene.TX1[face], scene.TY1[face], scene.TZ1[face]) + b[2]*vec3(scene.TX2[face], scene.TY2[face], scene.TZ2[face]);
+                        const vec3 B = b[0]*vec3(scene.BX0[face], scene.BY0[face], scene.BZ0[face]) + b[1]*vec3(scene.BX1[face], scene.BY1[face], scene.BZ1[face]) + b[2]*vec3(scene.BX2[face], scene.BY2[face], scene.BZ2[face]);
+                        const vec3 N = b[0]*vec3(scene.NX0[face], scene.NY0[face], scene.NZ0[face]) + b[1]*vec3(scene.NX1[face], scene.NY1[face], scene.NZ1[face]) + b[2]*vec3(scene.NX2[face], scene.NY2[face], scene.NZ2[face]);
+                        /*if(scene.faces[faceIndex*2].reflect) {
+                            for(uint t: range(tSize)) for(uint s: range(sSize)) {
+                                const vec3 viewpoint = vec3((s/float(sSize-1))*2-1, (t/float(tSize-1))*2-1, 0)/scene.scale;
+                                const vec3 D = normalize(P-viewpoint);
+                                bgr3f color = scene.shade(faceIndex*2+0, P, D, T, B, N, randoms[id]);
+                                const size_t base = base0 + (sSize * t + s) * VU;
+                                faceBGR[0*size4+base] += color.b;
+                                faceBGR[1*size4+base] += color.g;
+                                faceBGR[2*size4+base] += color.r;
+                            }
+                        } else*/ {
+                            const vec3 D = normalize(P);
+                            bgr3f colors[Radiosity::maxGroupCount];
+                            radiosity.shade(face, P, D, T, B, N, randoms[id], colors);
+                            bgr3f sum = 0;
+                            for(uint g: range(scene.groupCount)) {
+                                const bgr3f color = colors[g];
+                                sum += color;
+                                for(uint t: range(tSize)) for(uint s: range(sSize)) {
+                                    const size_t base = g*groupStride + base0 + (sSize * t + s) * size2;
+                                    faceBGR[0*size4+base] += color.b;
+                                    faceBGR[1*size4+base] += color.g;
+                                    faceBGR[2*size4+base] += color.r;
+                                }
+                            }
+                            squares[diffuseBase+base0] += sq((sum.b+sum.g+sum.r)/3);
                         }
                     }
                 }
             });
+            progress = ::min(batch+batchSize, work.size);
         }
+        Locker lock(stepLock);
+        while(pauses) pthread_cond_wait(&stepResume, &stepLock);
+        for(size_t chart: range(charts.size)) if(!converged(chart)) { iterations[chart]++; dirty[chart] = true; }
+        progress = 0;
         scene.iterations++;
+        if(scene.iterations%checkpointInterval == 0) checkpoint();
+        publish();
+        { // Convergence of bounces
+            float energy = 0;
+            for(const float sum: chartSum) energy += sum;
+            energyChange = this->energy ? abs(energy-this->energy)/this->energy : inff;
+            this->energy = energy;
+        }
     }
 };
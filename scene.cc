@@ -17,6 +17,28 @@ template<> inline uint3 parse<uint3>(TextData& s) { return parseVec<uint3>(s); }
 template<> inline uint4 parse<uint4>(TextData& s) { return parseVec<uint4>(s); }
 template<> inline vec3 parse<vec3>(TextData& s) { return parseVec<vec3>(s); }
 
+/// Normalizes light sampling distribution and fits scene within view
+static void fit(Scene& scene) {
+    if(scene.CAF) {
+        for(float& v: scene.area) v /= scene.CAF.last();
+        for(float& v: scene.CAF) v /= scene.CAF.last();
+        assert_(scene.CAF.last()==1);
+    }
+
+    // Fits scene
+    scene.min = inff, scene.max = -inff;
+    scene.min = ::min(scene.min, vec3(::min(scene.X0), ::min(scene.Y0), ::min(scene.Z0)));
+    scene.max = ::max(scene.max, vec3(::max(scene.X0), ::max(scene.Y0), ::max(scene.Z0)));
+    scene.min = ::min(scene.min, vec3(::min(scene.X1), ::min(scene.Y1), ::min(scene.Z1)));
+    scene.max = ::max(scene.max, vec3(::max(scene.X1), ::max(scene.Y1), ::max(scene.Z1)));
+    scene.min = ::min(scene.min, vec3(::min(scene.X2), ::min(scene.Y2), ::min(scene.Z2)));
+    scene.max = ::max(scene.max, vec3(::max(scene.X2), ::max(scene.Y2), ::max(scene.Z2)));
+    scene.max.z += 0x1p-8; // Prevents back and far plane from Z-fighting
+    scene.scale = 2./::max(scene.max.x-scene.min.x, scene.max.y-scene.min.y);
+    scene.near = scene.scale*scene.min.z;
+    scene.far = scene.scale*scene.max.z;
+}
+
 Scene parseScene(ref<byte> file) {
     TextData s (file);
     while(s.match('#')) s.until('\n');
@@ -71,9 +93,9 @@ Scene parseScene(ref<byte> file) {
             scene.U0[faceIndex] = 0;
             scene.U1[faceIndex] = 1;
             scene.U2[faceIndex] = 1;
-            scene.U0[faceIndex] = 0;
-            scene.U1[faceIndex] = 0;
-            scene.U2[faceIndex] = 1;
+            scene.V0[faceIndex] = 0;
+            scene.V1[faceIndex] = 0;
+            scene.V2[faceIndex] = 1;
 
             scene.TX0[faceIndex] = T.x;
             scene.TX1[faceIndex] = T.x;
@@ -111,6 +133,10 @@ Scene parseScene(ref<byte> file) {
             scene.NZ1[faceIndex] = N.z;
             scene.NZ2[faceIndex] = N.z;
 
+            scene.FNX[faceIndex] = N.x;
+            scene.FNY[faceIndex] = N.y;
+            scene.FNZ[faceIndex] = N.z;
+
             if(N.y == 1 && polygon[0].y==0) {
                 scene.emittanceB[faceIndex] = emittance;
                 scene.emittanceG[faceIndex] = emittance;
@@ -159,9 +185,9 @@ Scene parseScene(ref<byte> file) {
             scene.U0[faceIndex] = 0;
             scene.U1[faceIndex] = 1;
             scene.U2[faceIndex] = 0;
-            scene.U0[faceIndex] = 0;
-            scene.U1[faceIndex] = 1;
-            scene.U2[faceIndex] = 1;
+            scene.V0[faceIndex] = 0;
+            scene.V1[faceIndex] = 1;
+            scene.V2[faceIndex] = 1;
 
             scene.TX0[faceIndex] = T.x;
             scene.TX1[faceIndex] = T.x;
@@ -199,6 +225,10 @@ Scene parseScene(ref<byte> file) {
             scene.NZ1[faceIndex] = N.z;
             scene.NZ2[faceIndex] = N.z;
 
+            scene.FNX[faceIndex] = N.x;
+            scene.FNY[faceIndex] = N.y;
+            scene.FNZ[faceIndex] = N.z;
+
             if(N.y == 1 && polygon[0].y==0) {
                 scene.emittanceB[faceIndex] = emittance;
                 scene.emittanceG[faceIndex] = emittance;
@@ -224,21 +254,273 @@ Scene parseScene(ref<byte> file) {
         }
         faceIndex++;
     }
-    for(float& v: scene.area) v /= scene.CAF.last();
-    for(float& v: scene.CAF) v /= scene.CAF.last();
-    assert_(scene.CAF.last()==1);
+    fit(scene);
+    return scene;
+}
 
-    // Fits scene
-    scene.min = inff, scene.max = -inff;
-    scene.min = ::min(scene.min, vec3(::min(scene.X0), ::min(scene.Y0), ::min(scene.Z0)));
-    scene.max = ::max(scene.max, vec3(::max(scene.X0), ::max(scene.Y0), ::max(scene.Z0)));
-    scene.min = ::min(scene.min, vec3(::min(scene.X1), ::min(scene.Y1), ::min(scene.Z1)));
-    scene.max = ::max(scene.max, vec3(::max(scene.X1), ::max(scene.Y1), ::max(scene.Z1)));
-    scene.min = ::min(scene.min, vec3(::min(scene.X2), ::min(scene.Y2), ::min(scene.Z2)));
-    scene.max = ::max(scene.max, vec3(::max(scene.X2), ::max(scene.Y2), ::max(scene.Z2)));
-    scene.max.z += 0x1p-8; // Prevents back and far plane from Z-fighting
-    scene.scale = 2./::max(scene.max.x-scene.min.x, scene.max.y-scene.min.y);
-    scene.near = scene.scale*scene.min.z;
-    scene.far = scene.scale*scene.max.z;
+// -- Wavefront OBJ
+
+struct Material { String name; bgr3f diffuse, emission; };
+
+/// Parses MTL material library (diffuse reflectance Kd, emission Ke)
+static void parseMTL(ref<byte> file, array<Material>& materials) {
+    for(TextData s (file); s;) {
+        TextData line (s.line());
+        line.whileAny(" \t");
+        if(line.match("newmtl ")) materials.append(Material{copyRef(trim(line.untilAny("\r"))), bgr3f(0.f), bgr3f(0.f)});
+        else if(line.match("Kd ")) { assert_(materials); const vec3 rgb = parse<vec3>(line); materials.last().diffuse = bgr3f(rgb.z, rgb.y, rgb.x); }
+        else if(line.match("Ke ")) { assert_(materials); const vec3 rgb = parse<vec3>(line); materials.last().emission = bgr3f(rgb.z, rgb.y, rgb.x); }
+    }
+}
+
+Scene parseOBJ(ref<byte> file, const Folder& folder) {
+    // Counts triangles (polygons are triangulated as fans) (degenerate triangles are skipped: no normal)
+    array<vec3> positions;
+    size_t triangleCount = 0;
+    for(TextData s (file); s;) {
+        TextData line (s.line());
+        line.whileAny(" \t");
+        if(line.match("v ")) { positions.append(parse<vec3>(line)); continue; }
+        if(!line.match("f ")) continue;
+        int P[3]; // Position indices of fan origin, previous and current vertex
+        uint vertexCount = 0;
+        for(;;vertexCount++) {
+            line.whileAny(" \t\r");
+            if(!line) break;
+            const int p = line.integer();
+            line.whileNo(" \t\r");
+            const uint i = ::min(vertexCount, 2u);
+            P[i] = p < 0 ? positions.size+p : p-1;
+            if(vertexCount < 2) continue;
+            if(length(::cross(positions[P[1]]-positions[P[0]], positions[P[2]]-positions[P[0]])) > 0) triangleCount++;
+            P[1] = P[2];
+        }
+        assert_(vertexCount >= 3, vertexCount);
+    }
+
+    Scene scene (triangleCount);
+    // index=faceCount flags miss (raycast hits no face) (i.e background "face" color)
+    scene.emittanceB[triangleCount] = 0;
+    scene.emittanceG[triangleCount] = 0;
+    scene.emittanceR[triangleCount] = 0;
+    scene.reflectanceB[triangleCount] = 0;
+    scene.reflectanceG[triangleCount] = 0;
+    scene.reflectanceR[triangleCount] = 0;
+
+    array<vec3> normals;
+    size_t positionCount = 0; // Positions defined before current line (relative indices)
+    array<Material> materials;
+    const Material defaultMaterial {{}, bgr3f(1./2), bgr3f(0.f)};
+    int materialIndex = -1; // -1: default
+    size_t faceIndex = 0;
+    for(TextData s (file); s;) {
+        TextData line (s.line());
+        line.whileAny(" \t");
+        /**/ if(line.match("v ")) positionCount++; // Parsed by first pass
+        else if(line.match("vn ")) normals.append(parse<vec3>(line));
+        else if(line.match("mtllib ")) parseMTL(readFile(trim(line.untilAny("\r")), folder), materials);
+        else if(line.match("usemtl ")) {
+            const string name = trim(line.untilAny("\r"));
+            materialIndex = -1;
+            for(size_t i: range(materials.size)) if(materials[i].name == name) materialIndex = i;
+            if(materialIndex < 0) log("Unknown material", name);
+        } else if(line.match("f ")) {
+            int P[3], N[3]; // Position and normal indices of fan origin, previous and current vertex (-1: none)
+            for(uint vertexCount=0;;vertexCount++) {
+                line.whileAny(" \t\r");
+                if(!line) break;
+                const int p = line.integer();
+                int n = 0;
+                if(line.match('/')) {
+                    if(!line.wouldMatch('/')) line.integer(); // Texture coordinates are ignored (radiosity allocates its own parametrization)
+                    if(line.match('/')) n = line.integer();
+                }
+                const uint i = ::min(vertexCount, 2u);
+                P[i] = p < 0 ? positionCount+p : p-1;
+                N[i] = n < 0 ? normals.size+n : n-1;
+                if(vertexCount < 2) continue;
+
+                const Material& material = materialIndex >= 0 ? materials[materialIndex] : defaultMaterial;
+                const vec3 p0 = positions[P[0]], p1 = positions[P[1]], p2 = positions[P[2]];
+                const vec3 cross = ::cross(p1-p0, p2-p0);
+                const float lengthCross = length(cross);
+                if(!(lengthCross > 0)) { P[1] = P[2], N[1] = N[2]; continue; } // Skips degenerate triangle (not counted)
+                const vec3 faceN = cross/lengthCross;
+                scene.X0[faceIndex] = p0.x; scene.Y0[faceIndex] = p0.y; scene.Z0[faceIndex] = p0.z;
+                scene.X1[faceIndex] = p1.x; scene.Y1[faceIndex] = p1.y; scene.Z1[faceIndex] = p1.z;
+                scene.X2[faceIndex] = p2.x; scene.Y2[faceIndex] = p2.y; scene.Z2[faceIndex] = p2.z;
+                // Orthonormal tangent frame (vertex normals if given, face normal otherwise)
+                const vec3 T0 = normalize(p1-p0);
+                vec3 n[3];
+                for(uint v: range(3)) n[v] = N[v] >= 0 ? normalize(normals[N[v]]) : faceN;
+                vec3 t[3], b[3];
+                for(uint v: range(3)) {
+                    t[v] = normalize(T0 - dot(T0, n[v])*n[v]);
+                    b[v] = ::cross(n[v], t[v]);
+                }
+                scene.TX0[faceIndex] = t[0].x; scene.TY0[faceIndex] = t[0].y; scene.TZ0[faceIndex] = t[0].z;
+                scene.TX1[faceIndex] = t[1].x; scene.TY1[faceIndex] = t[1].y; scene.TZ1[faceIndex] = t[1].z;
+                scene.TX2[faceIndex] = t[2].x; scene.TY2[faceIndex] = t[2].y; scene.TZ2[faceIndex] = t[2].z;
+                scene.BX0[faceIndex] = b[0].x; scene.BY0[faceIndex] = b[0].y; scene.BZ0[faceIndex] = b[0].z;
+                scene.BX1[faceIndex] = b[1].x; scene.BY1[faceIndex] = b[1].y; scene.BZ1[faceIndex] = b[1].z;
+                scene.BX2[faceIndex] = b[2].x; scene.BY2[faceIndex] = b[2].y; scene.BZ2[faceIndex] = b[2].z;
+                scene.NX0[faceIndex] = n[0].x; scene.NY0[faceIndex] = n[0].y; scene.NZ0[faceIndex] = n[0].z;
+                scene.NX1[faceIndex] = n[1].x; scene.NY1[faceIndex] = n[1].y; scene.NZ1[faceIndex] = n[1].z;
+                scene.NX2[faceIndex] = n[2].x; scene.NY2[faceIndex] = n[2].y; scene.NZ2[faceIndex] = n[2].z;
+                scene.FNX[faceIndex] = faceN.x; scene.FNY[faceIndex] = faceN.y; scene.FNZ[faceIndex] = faceN.z;
+                // Placeholder parametrization (Render allocates charts)
+                scene.U0[faceIndex] = 0; scene.U1[faceIndex] = 1; scene.U2[faceIndex] = 0;
+                scene.V0[faceIndex] = 0; scene.V1[faceIndex] = 0; scene.V2[faceIndex] = 1;
+
+                scene.emittanceB[faceIndex] = material.emission.b;
+                scene.emittanceG[faceIndex] = material.emission.g;
+                scene.emittanceR[faceIndex] = material.emission.r;
+                scene.reflectanceB[faceIndex] = material.diffuse.b;
+                scene.reflectanceG[faceIndex] = material.diffuse.g;
+                scene.reflectanceR[faceIndex] = material.diffuse.r;
+                if(material.emission) {
+                    scene.lights.append( faceIndex );
+                    scene.area.append( lengthCross/2 );
+                    scene.CAF.append( (scene.CAF ? scene.CAF.last() : 0)+lengthCross/2 );
+                }
+                faceIndex++;
+                // Next fan triangle
+                P[1] = P[2], N[1] = N[2];
+            }
+        }
+    }
+    assert_(faceIndex == scene.size, faceIndex, scene.size);
+
+    { // Moves viewpoint to origin: centered in front of the scene (looking along +z)
+        vec3 min = inff, max = -inff;
+        for(vec3 p: positions) min = ::min(min, p), max = ::max(max, p);
+        const vec3 viewpoint ((min.x+max.x)/2, (min.y+max.y)/2, min.z - ::max(max.x-min.x, max.y-min.y));
+        for(size_t i: range(scene.size)) {
+            scene.X0[i] -= viewpoint.x; scene.Y0[i] -= viewpoint.y; scene.Z0[i] -= viewpoint.z;
+            scene.X1[i] -= viewpoint.x; scene.Y1[i] -= viewpoint.y; scene.Z1[i] -= viewpoint.z;
+            scene.X2[i] -= viewpoint.x; scene.Y2[i] -= viewpoint.y; scene.Z2[i] -= viewpoint.z;
+        }
+    }
+    fit(scene);
+    return scene;
+}
+
+// -- Binary cache
+
+/// Attributes stored in scene cache (in order)
+static buffer<float> Scene::* const sceneAttributes[] = {
+    &Scene::X0, &Scene::X1, &Scene::X2, &Scene::Y0, &Scene::Y1, &Scene::Y2, &Scene::Z0, &Scene::Z1, &Scene::Z2,
+    &Scene::U0, &Scene::U1, &Scene::U2, &Scene::V0, &Scene::V1, &Scene::V2,
+    &Scene::TX0, &Scene::TX1, &Scene::TX2, &Scene::TY0, &Scene::TY1, &Scene::TY2, &Scene::TZ0, &Scene::TZ1, &Scene::TZ2,
+    &Scene::BX0, &Scene::BX1, &Scene::BX2, &Scene::BY0, &Scene::BY1, &Scene::BY2, &Scene::BZ0, &Scene::BZ1, &Scene::BZ2,
+    &Scene::NX0, &Scene::NX1, &Scene::NX2, &Scene::NY0, &Scene::NY1, &Scene::NY2, &Scene::NZ0, &Scene::NZ1, &Scene::NZ2,
+    &Scene::FNX, &Scene::FNY, &Scene::FNZ,
+    &Scene::emittanceB, &Scene::emittanceG, &Scene::emittanceR, &Scene::reflectanceB, &Scene::reflectanceG, &Scene::reflectanceR};
+
+struct SceneHeader {
+    char magic[8];
+    uint version;
+    int64 sourceTime; // Modified times of source file and material libraries (hashed)
+    uint64 sourceHash; // Content hash of source file and material libraries
+    uint64 size, lightCount;
+    uint64 librariesSize; // Material library paths (newline separated) stored after lights
+    vec3 min, max;
+    float scale, near, far;
+};
+static constexpr char sceneMagic[8] = {'s','c','e','n','e',0,0,0};
+static constexpr uint sceneVersion = 3; // Increment on any change to Scene attributes or parseScene
+static constexpr size_t sceneHeaderSize = 128; // Aligns attributes
+static_assert(sizeof(SceneHeader) <= sceneHeaderSize, "");
+
+static size_t sceneCacheSize(size_t size, size_t lightCount, size_t librariesSize) {
+    return sceneHeaderSize + sizeof(sceneAttributes)/sizeof(*sceneAttributes)*align(8, size+1)*sizeof(float) + lightCount*(sizeof(uint)+2*sizeof(float)) + librariesSize;
+}
+
+/// Material libraries referenced by OBJ \a source (relative to its folder)
+static array<String> materialLibraries(const ref<byte> source) {
+    array<String> libraries;
+    for(TextData s (source); s;) {
+        TextData line (s.line());
+        line.whileAny(" \t");
+        if(line.match("mtllib ")) libraries.append(copyRef(trim(line.untilAny("\r"))));
+    }
+    return libraries;
+}
+
+/// Hashes modified times of source file and its material libraries
+static int64 sourceTime(const string path, const ref<string> libraries, const Folder& folder) {
+    uint64 time = hash(raw(File(path).modifiedTime()));
+    for(string library: libraries) time = hash(raw(File(library, folder).modifiedTime()), time);
+    return time;
+}
+
+/// Hashes contents of source file and its material libraries
+static uint64 sourceHash(const ref<byte> source, const ref<string> libraries, const Folder& folder) {
+    uint64 hash = ::hash(source);
+    for(string library: libraries) hash = ::hash(readFile(library, folder), hash);
+    return hash;
+}
+
+Scene loadScene(string name) {
+    const String path = sceneFile(name);
+    const Folder sourceFolder (path.contains('/') ? section(path,'/',0,-2) : "."_);
+    const Folder folder (name, "/var/tmp/"_, true);
+    if(existsFile("scene", folder)) {
+        Map map (File("scene", folder), Map::Prot(Map::Read|Map::Write), Map::Private); // Copy on write (Render scales texture coordinates)
+        const SceneHeader header = map.size >= sceneHeaderSize ? *(SceneHeader*)map.data : SceneHeader{};
+        const bool valid = ref<char>(header.magic, 8) == ref<char>(sceneMagic, 8) && header.version == sceneVersion
+                && map.size == sceneCacheSize(header.size, header.lightCount, header.librariesSize);
+        const string librariesData = valid ? string((char*)map.data+map.size-header.librariesSize, header.librariesSize) : ""_;
+        const buffer<string> libraries = librariesData ? split(librariesData, "\n"_) : buffer<string>();
+        const int64 sourceTime = valid ? ::sourceTime(path, libraries, sourceFolder) : 0;
+        if(valid && (header.sourceTime == sourceTime || header.sourceHash == sourceHash(readFile(path), libraries, sourceFolder))) {
+            if(header.sourceTime != sourceTime) { // Touched but unmodified
+                SceneHeader touched = header;
+                touched.sourceTime = sourceTime;
+                File("scene", folder, Flags(ReadWrite)).write(raw(touched));
+            }
+            Scene scene (header.size);
+            scene.map = ::move(map);
+            size_t offset = sceneHeaderSize;
+            for(buffer<float> Scene::* attribute: sceneAttributes) {
+                buffer<float>& data = scene.*attribute;
+                data = buffer<float>((float*)(scene.map.data+offset), data.size, 0);
+                offset += scene.capacity*sizeof(float);
+            }
+            const size_t lightCount = header.lightCount;
+            scene.lights = copyRef(ref<uint>((uint*)(scene.map.data+offset), lightCount)); offset += lightCount*sizeof(uint);
+            scene.area = copyRef(ref<float>((float*)(scene.map.data+offset), lightCount)); offset += lightCount*sizeof(float);
+            scene.CAF = copyRef(ref<float>((float*)(scene.map.data+offset), lightCount)); offset += lightCount*sizeof(float);
+            assert_(offset+header.librariesSize == scene.map.size);
+            scene.min = header.min, scene.max = header.max;
+            scene.scale = header.scale, scene.near = header.near, scene.far = header.far;
+            return scene;
+        }
+    }
+    const buffer<byte> source = readFile(path);
+    const bool obj = endsWith(path, ".obj");
+    Scene scene = obj ? parseOBJ(source, sourceFolder) : parseScene(source);
+    { // Writes cache
+        const array<String> libraries = obj ? materialLibraries(source) : array<String>();
+        const String librariesData = join(libraries, "\n"_);
+        File file("scene", folder, Flags(ReadWrite|Create|Truncate));
+        file.resize(sceneCacheSize(scene.size, scene.lights.size, librariesData.size));
+        Map map (file, Map::Prot(Map::Read|Map::Write));
+        SceneHeader& header = *(SceneHeader*)map.data;
+        header = {{}, sceneVersion, sourceTime(path, toRefs(libraries), sourceFolder), sourceHash(source, toRefs(libraries), sourceFolder),
+                  scene.size, scene.lights.size, librariesData.size, scene.min, scene.max, scene.scale, scene.near, scene.far};
+        mref<char>(header.magic, 8).copy(ref<char>(sceneMagic, 8));
+        size_t offset = sceneHeaderSize;
+        for(buffer<float> Scene::* attribute: sceneAttributes) {
+            const buffer<float>& data = scene.*attribute;
+            mref<float>((float*)(map.data+offset), scene.capacity).copy(ref<float>(data.data, scene.capacity));
+            offset += scene.capacity*sizeof(float);
+        }
+        mref<uint>((uint*)(map.data+offset), scene.lights.size).copy(scene.lights); offset += scene.lights.size*sizeof(uint);
+        mref<float>((float*)(map.data+offset), scene.area.size).copy(scene.area); offset += scene.area.size*sizeof(float);
+        mref<float>((float*)(map.data+offset), scene.CAF.size).copy(scene.CAF); offset += scene.CAF.size*sizeof(float);
+        mref<char>((char*)map.data+offset, librariesData.size).copy(librariesData); offset += librariesData.size;
+        assert_(offset == map.size);
+    }
     return scene;
 }
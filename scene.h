@@ -1,14 +1,7 @@
 #pragma once
 #include "matrix.h"
 #include "simd.h"
-
-#define HALF 0 // FIXME: Accumulate singles, sample halfs
-#if HALF
-#error
-typedef half Float;
-#else
-typedef float Float;
-#endif
+#include "file.h"
 
 struct Scene {
     const size_t size;
@@ -58,6 +51,9 @@ struct Scene {
     buffer<float> NZ1 {capacity, size};
     buffer<float> NZ2 {capacity, size};
      // Face attributes
+    buffer<float> FNX {capacity, size}; // Geometric normal (culling, visibility) (vertex normals only shade)
+    buffer<float> FNY {capacity, size};
+    buffer<float> FNZ {capacity, size};
     buffer<float> emittanceB {capacity, size+1};
     buffer<float> emittanceG {capacity, size+1};
     buffer<float> emittanceR {capacity, size+1};
@@ -77,6 +73,12 @@ struct Scene {
     buffer<uint> size4 {capacity, size};
     buffer<v8si> sample4D {capacity, size};
     buffer<v4sf> Wts {capacity, size};
+    buffer<uint> diffuseBGR {capacity, size}; // View independent (u,v) texture
+
+    // Light groups (radiance solved separately for the emitters of each group, recombined with gains)
+    uint groupCount = 1;
+    buffer<uint> group {capacity, size+1}; // Light group of each face (only significant for emitters)
+    array<bgr3f> gain; // Intensity and color of each group (recombination)
 
     array<uint> lights; // Face index of lights
     array<float> area; // Area of lights (sample proportionnal to area) (Divided by sum)
@@ -85,37 +87,74 @@ struct Scene {
     vec3 min, max;
     float scale, near, far;
 
-    mref<Float> samples;
+    mref<float> accumulation; // Sum of radiance estimates of all iterations
+    mref<float> samples; // Mean radiance (published after each iteration)
+    mref<float> diffuse; // Mean radiance averaged over (s,t) (published after each iteration)
+    mref<float> diffuseBasis; // Mean radiance averaged over (s,t) of each light group (unit gain) (published after each iteration)
     uint sSize = 0, tSize = 0;
+    bool interleaved = false; // Layout of published samples (see setSTSize)
     uint iterations = 0;
+
+    Map map; // Backs attributes when loaded from cache
 };
 
+/// Hashes \a data (FNV-1a)
+inline uint64 hash(const ref<byte> data, uint64 hash = 0xcbf29ce484222325) {
+    for(byte b: data) { hash ^= uint8(b); hash *= 0x100000001b3; }
+    return hash;
+}
+
+/// Hashes geometry and materials (identifies solutions)
+inline uint64 hash(const Scene& scene) {
+    const buffer<float>* arrays[] = {&scene.X0, &scene.X1, &scene.X2, &scene.Y0, &scene.Y1, &scene.Y2, &scene.Z0, &scene.Z1, &scene.Z2,
+                                     &scene.emittanceB, &scene.emittanceG, &scene.emittanceR,
+                                     &scene.reflectanceB, &scene.reflectanceG, &scene.reflectanceR};
+    uint64 hash = ::hash(raw(scene.size));
+    for(const buffer<float>* data: arrays) hash = ::hash(cast<byte>(ref<float>(*data)), hash);
+    return hash;
+}
 
-inline void setSTSize(Scene& scene, const uint sSize, const uint tSize) {
+/// Groups emitters of identical emittance (i.e material) in at most \a maxGroupCount light groups (unit gains)
+/// \note Emitters beyond the last group are merged with it
+inline void groupLights(Scene& scene, const uint maxGroupCount) {
+    assert_(maxGroupCount >= 1);
+    array<bgr3f> emittances;
+    scene.group.clear(0);
+    for(uint face: scene.lights) {
+        const bgr3f E (scene.emittanceB[face], scene.emittanceG[face], scene.emittanceR[face]);
+        size_t group = emittances.size;
+        for(size_t i: range(emittances.size)) if(emittances[i] == E) group = i;
+        if(group == emittances.size) {
+            if(emittances.size < maxGroupCount) emittances.append(E);
+            else group = maxGroupCount-1;
+        }
+        scene.group[face] = group;
+    }
+    scene.groupCount = ::max(size_t(1), emittances.size);
+    scene.gain.clear();
+    for(uint unused group: range(scene.groupCount)) scene.gain.append(bgr3f(1));
+}
+
+/// Sets (s,t) sample count and layout of published samples (of each face at BGR)
+/// \param interleaved false: B, G, R planes of (s,t) images ([c][t][s][v][u]) gathered by sample4D offsets
+///                    true: B, G, R of all (s,t) samples contiguous for each texel ([v][u][t][s][c]) loaded as 2 spans by (u,v) corner
+inline void setSTSize(Scene& scene, const uint sSize, const uint tSize, bool interleaved = false) {
     scene.sSize = sSize; scene.tSize = tSize;
+    scene.interleaved = interleaved;
     for(size_t faceIndex: range(scene.size)) {
         const int    size1 = scene.size1[faceIndex];
         const int    size2 = scene.size2[faceIndex];
         const int    size3 = sSize      *size2;
         const size_t size4 = tSize      *size3;
         scene.size4[faceIndex] = size4;
-#if HALF // Half
-        scene.sample4D[faceIndex] = {    0,           size1/2,         size2/2,       (size2+size1)/2,
-                                   size3/2,   (size3+size1)/2, (size3+size2)/2, (size3+size2+size1)/2};
-        if(sSize == 1 || tSize ==1) // Prevents OOB
-            sample4D[faceIndex] = {    0,           size1/2,         0,       size1/2,
-                                       0,           size1/2,         0,       size1/2};
-#else  // Single
         scene.sample4D[faceIndex] = {    0,           size1,         size2,       (size2+size1),
                                      size3,   (size3+size1), (size3+size2), (size3+size2+size1)};
         if(sSize == 1 || tSize ==1) // Prevents OOB
             scene.sample4D[faceIndex] = {    0,           size1,         0,       size1,
                                              0,           size1,         0,       size1};
-#endif
     }
 }
 
-// FIXME: TODO: store diffuse (average s,t) texture for non-primary (diffuse) evaluation
 inline void setST(Scene& scene, const float S, const float T) {
     const float s = ::min(S * (scene.sSize-1), scene.sSize-1-0x1p-18f);
     const float t = ::min(T * (scene.tSize-1), scene.tSize-1-0x1p-18f);
@@ -124,32 +163,53 @@ inline void setST(Scene& scene, const float S, const float T) {
     for(size_t faceIndex: range(scene.size)) {
         const int    size2 = scene.size2[faceIndex];
         const int    size3 = scene.sSize     *size2;
-        scene.BGRst[faceIndex] = scene.BGR[faceIndex] + tIndex*size3 + sIndex*size2;
+        scene.BGRst[faceIndex] = scene.BGR[faceIndex] + (scene.interleaved ? 3*(tIndex*scene.sSize + sIndex) : tIndex*size3 + sIndex*size2);
         scene.Wts[faceIndex] = {(1-fract(t))*(1-fract(s)), (1-fract(t))*fract(s), fract(t)*(1-fract(s)), fract(t)*fract(s)};
     }
 }
 
+/// Samples interleaved layout: each (u,v) corner loads (s, s+1) BGR of rows t and t+1 (2 contiguous spans of 6 samples)
+inline bgr3f sampleInterleaved(const Scene& scene, const uint face, const float u, const float v) {
+    const int vIndex = v, uIndex = u; // Floor
+    const size_t texel = 3*scene.sSize*scene.tSize; // Samples per texel
+    const size_t row = scene.size1[face]*texel;
+    const size_t t1 = scene.tSize > 1 ? 3*scene.sSize : 0; // Prevents OOB
+    const float* const S = scene.samples.data + scene.BGRst[face] + (vIndex*scene.size1[face] + uIndex)*texel;
+    const v4sf Wts = scene.Wts[face];
+    const float fu = u-uIndex, fv = v-vIndex;
+    const float Wuv[4] = {(1-fu)*(1-fv), fu*(1-fv), (1-fu)*fv, fu*fv};
+    const size_t corner[4] = {0, texel, row, row+texel};
+    v8sf W0 = {Wts[0], Wts[0], Wts[0], Wts[1], Wts[1], Wts[1], 0, 0}; // (s, s+1) of row t
+    v8sf W1 = {Wts[2], Wts[2], Wts[2], Wts[3], Wts[3], Wts[3], 0, 0}; // (s, s+1) of row t+1
+    if(scene.sSize == 1) { // Prevents OOB (s+1 would load next texel)
+        W0 = {Wts[0]+Wts[1], Wts[0]+Wts[1], Wts[0]+Wts[1], 0, 0, 0, 0, 0};
+        W1 = {Wts[2]+Wts[3], Wts[2]+Wts[3], Wts[2]+Wts[3], 0, 0, 0, 0, 0};
+    }
+    v8sf sum = 0;
+    for(uint i: range(4)) {
+        const float* const P = S + corner[i];
+        v8sf y0, y1; __builtin_memcpy(&y0, P, sizeof(y0)); __builtin_memcpy(&y1, P+t1, sizeof(y1)); // Unaligned
+        sum += Wuv[i] * (W0*y0 + W1*y1);
+    }
+    return bgr3f(sum[0]+sum[3], sum[1]+sum[4], sum[2]+sum[5]);
+}
+
 inline bgr3f sample(const Scene& scene, const uint face, const float u, const float v) {
     assert_(u >= 0 && u < scene.size1[face] && v >= 0 && v < scene.V[face], u, v);
     const int vIndex = v, uIndex = u; // Floor
-#if HALF // Half
-    const size_t base = 2*sample4D[face][1]*vIndex + uIndex;
-    const v16sf B = toFloat((v16hf)gather((float*)(face.BGR[0]+base), sample4D[face]));
-    const v16sf G = toFloat((v16hf)gather((float*)(face.BGR[1]+base), sample4D[face]));
-    const v16sf R = toFloat((v16hf)gather((float*)(face.BGR[2]+base), sample4D[face]));
-#else  // Single
-    const size_t base = scene.sample4D[face][1]*vIndex + uIndex;
-    const v8sf b0 = gather((float*)(scene.BGR[0]+base), scene.sample4D[face]);
-    const v8sf b1 = gather((float*)(scene.BGR[0]+base+1), scene.sample4D[face]);
+    if(scene.interleaved) return sampleInterleaved(scene, face, u, v);
+    const float* const B0 = scene.samples.data + scene.BGRst[face] + vIndex*scene.size1[face] + uIndex;
+    const size_t size4 = scene.size4[face];
+    const v8sf b0 = gather(B0+0*size4, scene.sample4D[face]);
+    const v8sf b1 = gather(B0+0*size4+1, scene.sample4D[face]);
     const v16sf B = shuffle(b0, b1, 0, 8+0, 1, 8+1, 2, 8+2, 3, 8+3, 4, 8+4, 5, 8+5, 6, 8+6, 7, 8+7);
-    const v8sf g0 = gather((float*)(scene.BGR[1]+base), scene.sample4D[face]);
-    const v8sf g1 = gather((float*)(scene.BGR[1]+base+1), scene.sample4D[face]);
+    const v8sf g0 = gather(B0+1*size4, scene.sample4D[face]);
+    const v8sf g1 = gather(B0+1*size4+1, scene.sample4D[face]);
     const v16sf G = shuffle(g0, g1, 0, 8+0, 1, 8+1, 2, 8+2, 3, 8+3, 4, 8+4, 5, 8+5, 6, 8+6, 7, 8+7);
-    const v8sf r0 = gather((float*)(scene.BGR[2]+base), scene.sample4D[face]);
-    const v8sf r1 = gather((float*)(scene.BGR[2]+base+1), scene.sample4D[face]);
+    const v8sf r0 = gather(B0+2*size4, scene.sample4D[face]);
+    const v8sf r1 = gather(B0+2*size4+1, scene.sample4D[face]);
     const v16sf R = shuffle(r0, r1, 0, 8+0, 1, 8+1, 2, 8+2, 3, 8+3, 4, 8+4, 5, 8+5, 6, 8+6, 7, 8+7);
-#endif
-    const v4sf Wts = scene.Wts[face]; // FIXME: TODO: store diffuse (average s,t) texture for non-primary (diffuse) evaluation
+    const v4sf Wts = scene.Wts[face];
     const v4sf vuvu = {v, u, v, u};
     const v4sf w_1mw = abs(vuvu - floor(vuvu) - _1100f); // 1-fract(x), fract(x)
     const v16sf w01 = shuffle(  Wts,   Wts, 0,0,0,0,1,1,1,1, 2,2,2,2,3,3,3,3)  // 0000111122223333
@@ -158,8 +218,85 @@ inline bgr3f sample(const Scene& scene, const uint face, const float u, const fl
     return bgr3f(dot(w01, B), dot(w01, G), dot(w01, R));
 }
 
+/// Samples view independent (average s,t) texture (secondary bounces, low detail)
+inline bgr3f sampleDiffuse(const Scene& scene, const uint face, const float u, const float v) {
+    assert_(u >= 0 && u < scene.size1[face] && v >= 0 && v < scene.V[face], u, v);
+    const int vIndex = v, uIndex = u; // Floor
+    const size_t size1 = scene.size1[face], size2 = scene.size2[face];
+    const float* const B = scene.diffuse.data + scene.diffuseBGR[face] + vIndex*size1 + uIndex;
+    const float* const G = B + size2;
+    const float* const R = G + size2;
+    const float fu = u-uIndex, fv = v-vIndex;
+    const v4sf w01 = {(1-fu)*(1-fv), fu*(1-fv), (1-fu)*fv, fu*fv};
+    return bgr3f(dot(w01, (v4sf){B[0], B[1], B[size1], B[size1+1]}),
+                 dot(w01, (v4sf){G[0], G[1], G[size1], G[size1+1]}),
+                 dot(w01, (v4sf){R[0], R[1], R[size1], R[size1+1]}));
+}
+
+/// Texel index and bilinear weights (00, 01, 10, 11) of 8 (u,v) samples of \a face
+/// \note Clamps within chart (NaN to 0) (lanes outside coverage are extrapolated)
+inline v8si bilinear(const Scene& scene, const uint face, v8sf u, v8sf v, v8sf w[4]) {
+    u = ::min(::max(u, float8(0)), float8(scene.size1[face]-1)); // max(NaN, 0) = 0
+    v = ::min(::max(v, float8(0)), float8(scene.V[face]-1));
+    const v8si uIndex = cvtt(u), vIndex = cvtt(v); // Floor (non negative)
+    const v8sf fu = u-toFloat(uIndex), fv = v-toFloat(vIndex);
+    w[0] = (1-fu)*(1-fv), w[1] = fu*(1-fv), w[2] = (1-fu)*fv, w[3] = fu*fv;
+    return vIndex*int(scene.size1[face]) + uIndex;
+}
+
+/// Samples 8 (u,v) of \a face at current (s,t) (SoA)
+inline void sample(const Scene& scene, const uint face, v8sf u, v8sf v, v8sf& B, v8sf& G, v8sf& R) {
+    v8sf w[4];
+    const v8si texel = bilinear(scene, face, u, v, w);
+    const v4sf Wts = scene.Wts[face];
+    B = G = R = float8(0);
+    const float* const S = scene.samples.data + scene.BGRst[face];
+    if(scene.interleaved) { // [v][u][t][s][c]
+        const int size1 = scene.size1[face], texelSize = 3*scene.sSize*scene.tSize;
+        const int s1 = scene.sSize > 1 ? 3 : 0, t1 = scene.tSize > 1 ? 3*scene.sSize : 0; // Prevents OOB
+        const int uv[4] = {0, 1, size1, size1+1}, st[4] = {0, s1, t1, t1+s1};
+        const v8si base = texel*texelSize;
+        for(uint k: range(4)) for(uint j: range(4)) {
+            const v8si index = base + uv[k]*texelSize + st[j];
+            const v8sf wk = Wts[j]*w[k];
+            B += wk*gather(S+0, index);
+            G += wk*gather(S+1, index);
+            R += wk*gather(S+2, index);
+        }
+    } else { // [c][t][s][v][u]
+        const size_t size4 = scene.size4[face];
+        const v8si sample4D = scene.sample4D[face]; // (v, s, t) corners
+        for(uint k: range(8)) {
+            const v8si index = texel + sample4D[k];
+            const v8sf w0 = Wts[k/2]*w[(k%2)*2+0], w1 = Wts[k/2]*w[(k%2)*2+1]; // u, u+1
+            B += w0*gather(S+0*size4, index) + w1*gather(S+0*size4+1, index);
+            G += w0*gather(S+1*size4, index) + w1*gather(S+1*size4+1, index);
+            R += w0*gather(S+2*size4, index) + w1*gather(S+2*size4+1, index);
+        }
+    }
+}
+
+/// Samples 8 (u,v) of view independent (average s,t) texture of \a face (SoA)
+inline void sampleDiffuse(const Scene& scene, const uint face, v8sf u, v8sf v, v8sf& B, v8sf& G, v8sf& R) {
+    v8sf w[4];
+    const v8si texel = bilinear(scene, face, u, v, w);
+    const int size1 = scene.size1[face], size2 = scene.size2[face];
+    const int uv[4] = {0, 1, size1, size1+1};
+    B = G = R = float8(0);
+    const float* const S = scene.diffuse.data + scene.diffuseBGR[face];
+    for(uint k: range(4)) {
+        const v8si index = texel + uv[k];
+        B += w[k]*gather(S+0*size2, index);
+        G += w[k]*gather(S+1*size2, index);
+        R += w[k]*gather(S+2*size2, index);
+    }
+}
 
 Scene parseScene(ref<byte> scene);
+/// Parses Wavefront OBJ geometry and MTL materials (libraries relative to \a folder)
+Scene parseOBJ(ref<byte> file, const Folder& folder);
+/// Maps scene from binary cache (/var/tmp/name/scene), parses (and caches) source (.scene or .obj) if modified
+Scene loadScene(string name);
 
 inline string basename(string x) {
     string name = x.contains('/') ? section(x,'/',-2,-1) : x;
@@ -168,8 +305,6 @@ inline string basename(string x) {
     return basename;
 }
 
-#include "file.h"
-
 inline String sceneFile(string name) {
     if(existsFile(name)) return name+"/scene.json";
     if(existsFile(name+".scene")) return name+".scene";
@@ -11,23 +11,72 @@
 #include "view-widget.h"
 
 struct ViewApp {
-    Scene scene {::parseScene(readFile(sceneFile(basename(arguments()[0]))))};
-    Render renderer {scene};
+    Scene scene {::loadScene(basename(arguments()[0]))};
+    Render renderer {scene, Radiosity::AO, uint(arguments().size > 1 ? parseInteger(arguments()[1]) : 1), // Optional maximum light group count (relighting)
+                     size_t(arguments().size > 2 ? parseInteger(arguments()[2]) : 0)<<20}; // Optional resident sample map budget (MB) (out-of-core)
     Rasterizer<TextureShader> rasterizer {scene};
+    Rasterizer<TextureShader, 1> previewRasterizer {scene}; // Single sample per pixel (interactive preview)
+    bool preview = false;
+    Lock solverLock; // Held by solver during each iteration
+    Condition solverResume; // Signaled when no user waits for solverLock
+    uint waiting = 0; // Users waiting for solverLock (solver yields between iterations)
+    bool stop = false; // Terminates solver (checked between iterations)
+    Thread solverThread; // Refines solution in background
+    unique<Job> solver = nullptr;
+
+    /// Holds solverLock with priority over the solver (which otherwise reacquires it as soon as it releases it)
+    struct SolverLocker {
+        ViewApp& app;
+        SolverLocker(ViewApp& app) : app(app) { __sync_add_and_fetch(&app.waiting, 1); app.solverLock.lock(); }
+        ~SolverLocker() { __sync_sub_and_fetch(&app.waiting, 1); pthread_cond_broadcast(&app.solverResume); app.solverLock.unlock(); }
+    };
 
     const uint2 imageSize = 1024;
     bool rasterize = true; // Rasterizes prerendered textures or renders first bounce
     ImageF sumB, sumG, sumR;
     uint count = 0; // Iteration count (Resets on view angle change)
     vec2 angles = 0;
+    uint group = 0; // Light group selected for relighting
 
     ViewWidget view {1024, {this, &ViewApp::render}};
     unique<Window> window = nullptr;
 
     ViewApp() {
-        renderer.clear();
+        renderer.batchSize = 1024; // Interleaves solver and view use of thread pool
+        solver = unique<Job>(solverThread, function<void()>(this, &ViewApp::solve));
+        solverThread.spawn();
         window = ::window(&view);
         window->actions[Key('r')] = [this]{ rasterize=!rasterize; window->render(); };
+        window->actions[Key('d')] = [this]{ rasterizer.shader.diffuse=previewRasterizer.shader.diffuse=!rasterizer.shader.diffuse; window->render(); };
+        window->actions[Key('p')] = [this]{ preview=!preview; window->render(); }; // Toggles 1× (preview) and 16× multisampling
+        window->actions[Key('m')] = [this]{ // Cycles gathering mode (AO, Direct, Indirect) (resumes solution of each mode)
+            SolverLocker lock(*this);
+            renderer.setMode(Radiosity::Mode((renderer.radiosity.mode+1)%3));
+            window->render();
+        };
+        window->actions[Key('g')] = [this]{ group = (group+1)%scene.groupCount; log("Light group", group); };
+        window->actions[Key('+')] = [this]{ relight(2); };
+        window->actions[Key('-')] = [this]{ relight(1./2); };
+    }
+    /// Scales intensity of selected light group (recombines bases without solving)
+    /// \note Does not wait for the solver iteration (Render::relight pauses it between batches)
+    void relight(float factor) {
+        buffer<bgr3f> gain = copyRef(ref<bgr3f>(scene.gain));
+        gain[group] = factor * gain[group];
+        renderer.relight(gain);
+        window->render();
+    }
+    ~ViewApp() {
+        {SolverLocker lock(*this); stop = true;} // Waits for current iteration
+        solverThread.wait();
+    }
+    void solve() {
+        for(;;) {
+            Locker lock(solverLock);
+            while(waiting && !stop) pthread_cond_wait(&solverResume, &solverLock); // Yields to waiting users
+            if(stop) break;
+            renderer.step();
+        }
     }
     Image render(uint2 targetSize, vec2 angles) {
         Image target (targetSize);
@@ -38,25 +87,12 @@ struct ViewApp {
         M.scale(scene.scale); // Fits scene within -1, 1
 
         if(rasterize) {
-            ImageH B (target.size), G (target.size), R (target.size);
-            renderer.step(); // FIXME: async
+            Locker lock(renderer.publishLock); // Latest published iteration
             setST(scene, (s+1)/2, (t+1)/2);
-            ::rasterize(rasterizer, scene, M, (float[]){1,1,1}, {}, B, G, R);
-            assert_(target.size == B.size);
-            extern uint8 sRGB_forward[0x1000];
-            const float scale = float(0xFFF) / scene.iterations;
-            for(size_t i: range(target.ref::size)) {
-                uint b = uint(scale*B[i]);
-                uint g = uint(scale*G[i]);
-                uint r = uint(scale*R[i]);
-                /*b = clamp(0u, b, 0xFFFu); g = clamp(0u, g, 0xFFFu); r = clamp(0u, r, 0xFFFu);*/
-                //b = min(b, 0xFFFu); g = min(g, 0xFFFu); r = min(r, 0xFFFu);
-                assert_(b >= 0 && b <= 0xFFF, b);
-                assert_(g >= 0 && g <= 0xFFF, g);
-                assert_(r >= 0 && r <= 0xFFF, r);
-                target[i] = byte4(sRGB_forward[b], sRGB_forward[g], sRGB_forward[r], 0xFF);
-            }
+            if(preview) ::rasterize(previewRasterizer, scene, M, (float[]){1,1,1}, target);
+            else ::rasterize(rasterizer, scene, M, (float[]){1,1,1}, target);
         } else {
+            SolverLocker lock(*this); // Pauses solver (shares hemispheric rasterizer lookup)
             if(this->angles != angles || sumB.size != target.size) {
                 this->angles = angles;
                 count = 0; // Resets accumulation
@@ -73,16 +109,39 @@ struct ViewApp {
             Random randoms[threadCount()];
             for(Random& random: mref<Random>(randoms,threadCount())) random=Random();
             if(count>1) { Random random; renderer.radiosity.lookup.generate(random); } // Reuses previous set while view changes (temporal stability)
-            parallel_chunk(target.size.y, [this, &target, O, &randoms](const uint id, const size_t start, const size_t sizeI) {
-                const int targetSizeX = target.size.x;
-                for(size_t targetY: range(start, start+sizeI)) for(size_t targetX: range(targetSizeX)) {
-                    size_t targetIndex = targetY*targetSizeX+targetX;
-                    const vec2 uv = (vec2(targetX, targetY) / vec2(target.size-uint2(1)))*2.f - vec2(1) - O.xy()*scene.scale;
-                    const vec3 d = normalize(vec3(uv, scene.near));
-                    bgr3f color = renderer.radiosity.raycast_shade(O, d, randoms[id]);
-                    sumB[targetIndex] += color.b;
-                    sumG[targetIndex] += color.g;
-                    sumR[targetIndex] += color.r;
+            // Traces coherent 2×4 pixel blocks as 8 ray packets
+            parallel_chunk((target.size.y+1)/2, [this, &target, O, &randoms](const uint id, const size_t start, const size_t sizeI) {
+                const int targetSizeX = target.size.x, targetSizeY = target.size.y;
+                static constexpr v8sf blockX {0,1,2,3,0,1,2,3};
+                static constexpr v8sf blockY {0,0,0,0,1,1,1,1};
+                const vec2 scale = 2.f / vec2(target.size-uint2(1));
+                const vec2 offset = vec2(1) + O.xy()*scene.scale;
+                for(size_t blockIndexY: range(start, start+sizeI)) {
+                    const int targetY = blockIndexY*2;
+                    int targetX = 0;
+                    if(targetY+2 <= targetSizeY) for(; targetX+4 <= targetSizeX; targetX+=4) {
+                        const v8sf u = (float(targetX)+blockX)*scale.x - offset.x;
+                        const v8sf v = (float(targetY)+blockY)*scale.y - offset.y;
+                        const v8sf length = sqrt(u*u + v*v + sq(scene.near));
+                        bgr3f color[8];
+                        renderer.radiosity.raycast_shade(O, u/length, v/length, scene.near/length, randoms[id], color);
+                        for(uint k: range(8)) {
+                            const size_t targetIndex = (targetY+k/4)*targetSizeX+targetX+k%4;
+                            sumB[targetIndex] += color[k].b;
+                            sumG[targetIndex] += color[k].g;
+                            sumR[targetIndex] += color[k].r;
+                        }
+                    }
+                    // Single rays on partial blocks
+                    for(int y: range(targetY, ::min(targetY+2, targetSizeY))) for(int x: range(targetX, targetSizeX)) {
+                        size_t targetIndex = y*targetSizeX+x;
+                        const vec2 uv = vec2(x, y)*scale - offset;
+                        const vec3 d = normalize(vec3(uv, scene.near));
+                        bgr3f color = renderer.radiosity.raycast_shade(O, d, randoms[id]);
+                        sumB[targetIndex] += color.b;
+                        sumG[targetIndex] += color.g;
+                        sumR[targetIndex] += color.r;
+                    }
                 }
             });
 